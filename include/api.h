@@ -13,6 +13,15 @@ typedef struct {
 
 
 
+/// Chooses how the server sends the board (FRAME_MODE_GRID by default). Must be called before pacman_connect.
+void pacman_set_frame_mode(int mode);
+
+/// Chooses the channel of the server's messages (TRANSPORT_FIFO by default, or TRANSPORT_SHM for a
+/// shared memory ring read in place). The server may fall back to the FIFO. TRANSPORT_SOCKET replaces
+/// every FIFO with one connection to the server's socket. Must be called before pacman_connect.
+void pacman_set_transport(int transport);
+
+/// With TRANSPORT_SOCKET, server_pipe_path is the server's socket and req_pipe_path only identifies the client.
 int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
 
 void pacman_play(char command);
@@ -20,6 +29,9 @@ void pacman_play(char command);
 /// @return 0 if the disconnection was successful, 1 otherwise.
 int pacman_disconnect();
 
+/// Waits for the next board update. Deltas sent by the server are applied to the last frame received.
+/// @return the board; data points to a buffer owned by the library that stays valid until the next call
+/// and must not be freed.
 Board receive_board_update();
 
 #endif
\ No newline at end of file
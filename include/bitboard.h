@@ -0,0 +1,53 @@
+#ifndef BITBOARD_H
+#define BITBOARD_H
+
+#include <stdint.h>
+
+/*
+Bit-plane over a width x height grid, one bit per position.
+Every row starts on a word boundary (row_words words per row), so row queries
+only touch the words of that row.
+*/
+typedef struct {
+    uint64_t *words;
+    int row_words;
+} bitboard_t;
+
+/*Number of 64-bit words needed for a row of the given width*/
+static inline int bitboard_row_words(int width) {
+    return (width + 63) / 64;
+}
+
+static inline uint64_t *bitboard_row(const bitboard_t *bb, int y) {
+    return bb->words + (long)y * bb->row_words;
+}
+
+static inline int bitboard_test(const bitboard_t *bb, int x, int y) {
+    return (bitboard_row(bb, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+static inline void bitboard_set(bitboard_t *bb, int x, int y) {
+    bitboard_row(bb, y)[x >> 6] |= 1ULL << (x & 63);
+}
+
+static inline void bitboard_clear(bitboard_t *bb, int x, int y) {
+    bitboard_row(bb, y)[x >> 6] &= ~(1ULL << (x & 63));
+}
+
+/*Number of positions set in row y*/
+static inline int bitboard_count_row(const bitboard_t *bb, int y) {
+    const uint64_t *row = bitboard_row(bb, y);
+    int count = 0;
+    for (int w = 0; w < bb->row_words; w++) count += __builtin_popcountll(row[w]);
+    return count;
+}
+
+/*Number of positions set in the whole plane*/
+static inline int bitboard_count(const bitboard_t *bb, int height) {
+    long n_words = (long)height * bb->row_words;
+    int count = 0;
+    for (long w = 0; w < n_words; w++) count += __builtin_popcountll(bb->words[w]);
+    return count;
+}
+
+#endif
@@ -7,7 +7,9 @@
 #define MAX_FILENAME 256
 #define MAX_GHOSTS 25
 
-#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bitboard.h"
 
 typedef enum {
     REACHED_PORTAL = 1,
@@ -43,12 +45,55 @@ typedef struct {
     int charged;
 } ghost_t;
 
-typedef struct {
-    char content; // stuff like 'P' for pacman 'M' for monster and 'W' for wall
-    int has_dot; // whether there is a dot in this position or not
-    int has_portal; // whether there is a portal in this position or not
-    pthread_mutex_t lock;
-} board_pos_t;
+/*
+Packed board cell, one byte per position:
+bits 0-1 hold the content (empty, wall, pacman or monster), bit 2 the dot, bit 3 the portal
+and bit 4 marks a charged monster.
+A board is only ever modified by the tick of the session that owns it (single writer),
+so cells carry no lock.
+*/
+typedef uint8_t board_pos_t;
+
+#define CELL_EMPTY   0x00
+#define CELL_WALL    0x01
+#define CELL_PACMAN  0x02
+#define CELL_GHOST   0x03
+#define CELL_CONTENT 0x03 // mask of the content bits
+#define CELL_DOT     0x04
+#define CELL_PORTAL  0x08
+#define CELL_CHARGED 0x10
+#define CELL_BITS    0x1F // mask of every bit in use
+
+static inline int cell_content(board_pos_t cell) {
+    return cell & CELL_CONTENT;
+}
+
+static inline int cell_has_dot(board_pos_t cell) {
+    return (cell & CELL_DOT) != 0;
+}
+
+static inline int cell_has_portal(board_pos_t cell) {
+    return (cell & CELL_PORTAL) != 0;
+}
+
+static inline int cell_is_charged(board_pos_t cell) {
+    return (cell & CELL_CHARGED) != 0;
+}
+
+/*
+Character sent to the clients for a cell: '#' wall, 'C' pacman, 'M' monster, 'G' charged monster,
+'@' portal, '.' dot and ' ' empty. Indexed by the cell bits, so encoding a frame is one lookup per position.
+*/
+static inline char cell_frame_char(board_pos_t cell) {
+    static const char frame_chars[32] = " #CM.#CM@#CM@#CM #CG.#CG@#CG@#CG";
+    return frame_chars[cell & CELL_BITS];
+}
+
+/*Content as the legacy character: 'W' for wall, 'P' for pacman, 'M' for monster and ' ' for empty*/
+static inline char cell_char(board_pos_t cell) {
+    static const char content_chars[4] = {' ', 'W', 'P', 'M'};
+    return content_chars[cell & CELL_CONTENT];
+}
 
 typedef struct {
     int width, height; //dimensions of the board
@@ -61,8 +106,14 @@ typedef struct {
     char pacman_file[256]; // file with pacman movements
     char ghosts_files[MAX_GHOSTS][256]; // files with monster movements
     int tempo; // Duracao de cada jogada???
-    pthread_rwlock_t state_lock;
     int state;
+    // Bit-planes mirroring the cells, used for collisions and level-wide queries
+    bitboard_t walls;   // static layout
+    bitboard_t portals;
+    bitboard_t dots;    // dynamic occupancy
+    bitboard_t pacman_cells;
+    bitboard_t ghost_cells;
+    uint64_t *layers;   // storage shared by every plane
 } board_t;
 
 /*Move pacman/monster in a certain direction on the board must check for boundaries, walls and other monsters
@@ -82,10 +133,33 @@ int load_pacman(board_t* board);
 int load_ghost(board_t* board);
 
 
+/*Allocates the bit-planes for a board whose dimensions are already known*/
+void alloc_layers(board_t* board);
+
+/*Points the bit-planes at existing storage of layers_size bytes (e.g. a mapped level pack)*/
+void attach_layers(board_t* board, uint64_t* layers);
+
+/*Bytes of the storage of every bit-plane of a board*/
+size_t layers_size(const board_t* board);
+
+/*Writes a packed cell at (x, y) and keeps every bit-plane in sync with it*/
+void board_write_cell(board_t* board, int x, int y, board_pos_t cell);
+
+/*Number of dots still on the board*/
+int board_dots_left(board_t* board);
+
+/*Number of ghosts in row y*/
+int board_ghosts_in_row(board_t* board, int y);
+
 /*
 Fils the board with the information coming from the file
 */
 int load_level(board_t* board, char* filename, char* dirname, int accumulated_points);
+/*
+Fills the board with a copy of a level already loaded by load_level, which is left untouched,
+so many games can start from the same parsed level
+*/
+void copy_level(board_t* board, const board_t* level, int accumulated_points);
 // Unloads levels loaded by load_level
 void unload_level(board_t * board);
 
@@ -0,0 +1,119 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "board.h"
+#include "protocol.h"
+#include "shm_ring.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Frames sent as deltas between two full frames
+#define KEYFRAME_INTERVAL 100
+
+// Full frames at least this big are handed to the pipe with vmsplice instead of being copied by write
+#define VMSPLICE_MIN_BYTES (64 * 1024)
+
+/*
+Page-aligned frame buffer. The page before the cells holds the header of a full frame,
+so header and cells go out together from a single buffer.
+*/
+typedef struct {
+    char *cells;
+    size_t map_size;        // size of the mapping, 0 if not mapped
+    long long busy_until;   // stream position up to which the pipe may still reference these pages (vmsplice)
+} frame_buf_t;
+
+/*
+Outgoing frames of one client.
+Keeps what the client already has (the last frame, or the layout and dots in FRAME_MODE_ENTITIES),
+so the next frame only carries what changed.
+The buffers survive across clients and levels and only grow.
+*/
+typedef struct {
+    int fd;                 // notification pipe of the client
+    shm_ring_t *ring;       // TRANSPORT_SHM: ring the messages go to instead of fd (not owned)
+    int mode;               // FRAME_MODE_* chosen by the client
+    frame_buf_t frame;      // frame being encoded
+    frame_buf_t sent;       // last frame written to the client (base of the next delta)
+    size_t capacity;        // cells that fit in frame and sent
+    char *tx;               // deltas and entity lists: headers followed by their bodies
+    size_t tx_capacity;
+    const char *msg;        // encoded message, in tx or in the frame buffer
+    size_t msg_len;
+    size_t msg_off;         // bytes of msg already written
+    bool pending;           // msg is not fully written yet (the pipe was full)
+    bool msg_in_frame;      // the message is a full frame in the frame buffer
+    bool msg_spliced;       // msg is being sent with vmsplice
+    bool no_splice;         // the fd does not take vmsplice
+    bool is_socket;         // the fd is a SOCK_SEQPACKET connection: every message is one packet
+    long long stream_pos;   // bytes written to the client so far
+    uint64_t *sent_dots;    // FRAME_MODE_ENTITIES: dots plane as last sent to the client
+    size_t dots_capacity;   // words that fit in sent_dots
+    bool layout_sent;       // FRAME_MODE_ENTITIES: the client has the layout of the current level
+    int frame_width;        // dimensions of the encoded frame
+    int frame_height;
+    int sent_width;         // dimensions of the sent frame, 0 if the client has no base
+    int sent_height;
+    int since_keyframe;     // deltas sent since the last full frame
+    bool resync;            // the client asked for a full frame
+    // statistics of the current level
+    long frames;
+    long keyframes;
+    long dropped;           // frames skipped because the client had not read the previous one
+    long long bytes;
+} frame_out_t;
+
+/*Converts the board into the characters sent to the client*/
+void board_to_char(board_t *board, char* char_board);
+
+/*Forgets the client's base frame and statistics, keeping the buffers*/
+void frame_out_reset(frame_out_t *out);
+
+/*
+Starts sending to a new client on fd, a pipe or a connected socket (the buffers are reused).
+Messages go to fd until out->ring is set.
+*/
+void frame_out_attach(frame_out_t *out, int fd);
+
+/*
+Encodes the board into out->msg, without allocating once the buffers have grown to the board's size.
+In FRAME_MODE_GRID it is a full OP_CODE_BOARD frame or an OP_CODE_BOARD_DELTA; in FRAME_MODE_ENTITIES
+an OP_CODE_ENTITIES, preceded by an OP_CODE_LAYOUT when the client does not have the level's layout yet.
+header holds tempo, victory, game_over and points; the rest is filled in here.
+*/
+void frame_encode(frame_out_t *out, board_t *board, const msg_board_update_t *header);
+
+/*
+The fd is non-blocking: a message the pipe cannot take whole stays pending and is finished by frame_flush.
+The functions below return 1 if everything was written, 0 if part of the message is still pending
+and -1 if the write failed.
+*/
+
+/*
+Starts writing the encoded message (write, or vmsplice for big full frames) and makes it
+the base of the next delta. Nothing may be pending.
+*/
+int frame_send(frame_out_t *out);
+
+/*Starts writing a message that is not a frame (e.g. the connect response). Nothing may be pending*/
+int frame_write(frame_out_t *out, const void *buf, size_t len);
+
+/*Writes what is left of the pending message*/
+int frame_flush(frame_out_t *out);
+
+/*Largest single message frame_encode produces for a board of width x height with n_entities entities*/
+size_t frame_max_size(int mode, int width, int height, int n_entities);
+
+/*Bytes written to the client's pipe (or ring) that it has not read yet, -1 if unknown*/
+int frame_unread(frame_out_t *out);
+
+/*
+Creates the shared memory ring of the client whose notification pipe is notif_pipe_path (TRANSPORT_SHM).
+Returns NULL if it could not be created, in which case the client stays on the pipe.
+*/
+shm_ring_t *frame_ring_create(const char *notif_pipe_path);
+
+/*Unmaps the ring and removes its name*/
+void frame_ring_destroy(shm_ring_t *ring);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include "board.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compiled levels of a directory, loaded instead of the text files when present
+#define LEVEL_PACK_FILE "levels.pack"
+#define LEVEL_PACK_MAGIC "PACLVLS"
+// Bumped whenever the layout below, pacman_t, ghost_t or the cell bits change
+#define LEVEL_PACK_VERSION 1
+
+/*
+Level pack: a header, one entry per level in play order, then the data of every level.
+Offsets are from the start of the file and 8-byte aligned, so the server uses the data where it is mapped.
+*/
+typedef struct {
+    char magic[8];          // LEVEL_PACK_MAGIC
+    uint32_t version;       // LEVEL_PACK_VERSION
+    uint32_t n_levels;
+    uint64_t size;          // bytes of the whole file, to detect truncation
+} level_pack_header_t;
+
+typedef struct {
+    char name[MAX_FILENAME];
+    int32_t width, height;
+    int32_t tempo;
+    int32_t n_pacmans;
+    int32_t n_ghosts;
+    uint32_t reserved;
+    uint64_t cells;         // width * height packed cells, pacman and monsters already placed
+    uint64_t layers;        // bit-planes of the cells (layers_size bytes)
+    uint64_t pacmans;       // n_pacmans pacman_t with 0 points
+    uint64_t ghosts;        // n_ghosts ghost_t with their moves
+} level_pack_entry_t;
+
+/*
+Levels of the level directory, parsed once and shared by every session.
+The templates are never modified after level_cache_load: a game plays on a copy made by copy_level.
+A game holds a reference to the cache it started with, so a reload never changes the levels under it.
+*/
+typedef struct {
+    int n_levels;
+    board_t *levels;    // templates in play order (file names in natural order), loaded with 0 points
+    _Atomic int refs;   // playlist + games holding the cache
+    void *pack;         // mapping of the level pack the templates point into, NULL if parsed from text
+    size_t pack_size;
+} level_cache_t;
+
+/*
+Loads the levels of dirname: from its LEVEL_PACK_FILE when there is a valid one and no other file of
+the directory was modified after it, else by parsing every .lvl file. Returns NULL if the directory cannot be read.
+*/
+level_cache_t *level_cache_load(const char *dirname);
+
+/*Parses every .lvl file of dirname, ignoring any level pack. Returns NULL if the directory cannot be read*/
+level_cache_t *level_cache_load_text(const char *dirname);
+
+/*Frees the templates and the cache*/
+void level_cache_free(level_cache_t *cache);
+
+/*Drops a reference taken by level_playlist_acquire, freeing the cache with the last one (NULL is ignored)*/
+void level_cache_release(level_cache_t *cache);
+
+/*Writes the levels of the cache to a level pack at path. Returns 0 on success, -1 on error*/
+int level_pack_write(const level_cache_t *cache, const char *path);
+
+/*
+Playlist: the current cache of the level directory.
+level_playlist_init loads it and starts a thread that watches the directory with inotify; whenever
+files change it reloads the levels in the background and swaps the new cache in for the next games.
+Returns -1 if the directory cannot be read.
+*/
+int level_playlist_init(const char *dirname);
+
+/*Current levels, with a reference the caller drops with level_cache_release*/
+level_cache_t *level_playlist_acquire(void);
+
+/*Stops the watcher and drops the playlist's reference*/
+void level_playlist_stop(void);
+
+#endif
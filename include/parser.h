@@ -2,9 +2,11 @@
 #define PARSER_H
 
 #include "board.h"
-#define MAX_COMMAND_LENGTH 256
 
-int read_line(int fd, char* buffer);
+/*
+Level and script parsers. Each file is mapped once and read in place, without shared state,
+so several sessions may load levels at the same time.
+*/
 int read_level(board_t* board, char* filename, char* dirname);
 int read_pacman(board_t* board, int points);
 int read_ghosts(board_t* board);
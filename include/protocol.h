@@ -9,17 +9,38 @@ enum {
   OP_CODE_DISCONNECT = 2,
   OP_CODE_PLAY = 3,
   OP_CODE_BOARD = 4,
+  OP_CODE_RESYNC = 5,
+  OP_CODE_BOARD_DELTA = 6,
+  OP_CODE_LAYOUT = 7,
+  OP_CODE_ENTITIES = 8,
+};
+
+// How the server sends the board, chosen by the client when it registers
+enum {
+  FRAME_MODE_GRID = 0,      // OP_CODE_BOARD frames and OP_CODE_BOARD_DELTA patches
+  FRAME_MODE_ENTITIES = 1,  // OP_CODE_LAYOUT once per level, then OP_CODE_ENTITIES every tick
+};
+
+// Channel of the server->client messages after the connect response, asked by the client when it registers
+enum {
+  TRANSPORT_FIFO = 0,       // the notification pipe
+  TRANSPORT_SHM = 1,        // a shared memory ring created by the server for the session (shm_ring.h)
+  TRANSPORT_SOCKET = 2,     // a connection to the server's SOCK_SEQPACKET socket, one packet per message both ways
 };
 
 typedef struct {
   int op_code;
   char req_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
   char notif_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
+  int frame_mode;
+  int transport;
 } msg_registration_t;
 
+// transport is the channel the server chose; it falls back to TRANSPORT_FIFO if the one asked for is not available
 typedef struct {
   int op_code;
   int result;
+  int transport;
 }msg_reg_response_t;
 
 typedef struct {
@@ -37,4 +58,57 @@ typedef struct {
   int points;
 } msg_board_update_t;
 
+/*
+Board update carrying only the cells that changed since the previous frame.
+It is followed by length bytes holding n_spans spans, each one a msg_board_span_t
+and the span's cells, to be copied into the previous frame at offset.
+The client answers a delta it cannot apply with OP_CODE_RESYNC (sent as a msg_play_t)
+and the server replies with a full OP_CODE_BOARD frame.
+*/
+typedef struct {
+  int op_code;
+  int tempo;
+  int victory;
+  int game_over;
+  int points;
+  int n_spans;
+  int length;
+} msg_board_delta_t;
+
+typedef struct {
+  int offset;
+  int length;
+} msg_board_span_t;
+
+/*
+FRAME_MODE_ENTITIES: at level start (and on OP_CODE_RESYNC) the server sends an OP_CODE_LAYOUT,
+a msg_board_update_t followed by width*height cells holding only walls, portals and dots.
+Every frame is then a msg_entities_t followed by n_entities msg_entity_t (the pacman first,
+then the ghosts) and n_eaten ints, the positions (y*width+x) of the dots eaten since the previous frame.
+*/
+typedef struct {
+  int op_code;
+  int tempo;
+  int victory;
+  int game_over;
+  int points;
+  int n_entities;
+  int n_eaten;
+} msg_entities_t;
+
+enum {
+  ENTITY_ALIVE = 1,
+  ENTITY_CHARGED = 2,
+};
+
+typedef struct {
+  int x;
+  int y;
+  int flags;
+} msg_entity_t;
+
+// Every board header has the same size, so the client reads a fixed header and looks at op_code
+_Static_assert(sizeof(msg_board_delta_t) == sizeof(msg_board_update_t), "board headers must have the same size");
+_Static_assert(sizeof(msg_entities_t) == sizeof(msg_board_update_t), "board headers must have the same size");
+
 #endif
\ No newline at end of file
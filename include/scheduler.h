@@ -0,0 +1,52 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct sched_task sched_task_t;
+
+/*
+Runs one step of a task.
+Returns the absolute instant (ns, CLOCK_MONOTONIC) at which the task must run again,
+or -1 if the task is finished and must not be scheduled again.
+*/
+typedef long long (*sched_fn_t)(sched_task_t *task);
+
+struct sched_task {
+    long long deadline; // absolute instant (ns, CLOCK_MONOTONIC) at which the task is due
+    sched_fn_t run;     // step function
+    void *arg;          // owner of the task (e.g. the session)
+    // managed by the scheduler
+    uint64_t expires;   // deadline in timer wheel ticks
+    sched_task_t *next; // timer wheel slot list or ready list
+    sched_task_t *prev;
+    int state;          // idle, waiting in the wheel, ready or running
+    int wheel_level;    // wheel slot the task is in while waiting
+    int wheel_slot;
+    bool woken;         // its fd became readable while it was running
+};
+
+/*Current time of CLOCK_MONOTONIC in nanoseconds*/
+long long monotonic_ns(void);
+
+/*Starts the timer thread and n_workers worker threads that run due tasks*/
+int scheduler_start(int n_workers);
+
+/*Schedules a task to run at the absolute instant deadline (ns, CLOCK_MONOTONIC)*/
+void scheduler_submit(sched_task_t *task, long long deadline);
+
+/*
+Also runs the task as soon as fd becomes readable, ahead of its deadline.
+A step can tell an early run by monotonic_ns() < task->deadline.
+Returns 0 on success, -1 on error.
+*/
+int scheduler_watch(sched_task_t *task, int fd);
+
+/*Stops waking a task on fd (must be called before closing it)*/
+void scheduler_unwatch(int fd);
+
+/*Number of workers that matches the number of online cores*/
+int scheduler_default_workers(void);
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// Bytes of messages a session's ring holds (power of two); a message may use at most half of it
+#define SHM_RING_SIZE (8u << 20)
+
+#define SHM_RING_NAME_LENGTH (MAX_PIPE_PATH_LENGTH + 16)
+
+// Length of the record that tells the reader the next record starts at the beginning of data
+#define SHM_RING_WRAP 0xFFFFFFFFu
+
+/*
+Single-producer single-consumer ring of server->client messages (TRANSPORT_SHM), in a POSIX shared
+memory segment the server creates for the session. Every record is a uint32_t length followed by the
+message, padded to 8 bytes so the client reads the headers in place. A record never wraps: when it does
+not fit before the end of data, a SHM_RING_WRAP length sends the reader back to the start.
+head and tail count bytes and only grow (modulo 2^32). The client sleeps on head with a futex
+after setting waiting, and the server wakes it when it publishes a record and finds waiting set.
+*/
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head;  // bytes published by the server
+    _Atomic uint32_t waiting;            // the client is sleeping on head
+    _Alignas(64) _Atomic uint32_t tail;  // bytes released by the client
+    uint32_t size;                       // bytes in data
+    char name[SHM_RING_NAME_LENGTH];     // name of the segment, so either side can unlink it
+    _Alignas(64) char data[];
+} shm_ring_t;
+
+/*Name of the segment of the client whose notification pipe is notif_pipe_path*/
+static inline void shm_ring_name(char *name, const char *notif_pipe_path) {
+    // "/pacman" followed by the path with every '/' turned into '_'
+    size_t n = strlen("/pacman");
+    memcpy(name, "/pacman", n);
+    for (const char *c = notif_pipe_path; *c != '\0' && n < SHM_RING_NAME_LENGTH - 1; c++) {
+        name[n++] = (*c == '/') ? '_' : *c;
+    }
+    name[n] = '\0';
+}
+
+static inline size_t shm_ring_map_size(uint32_t size) {
+    return sizeof(shm_ring_t) + size;
+}
+
+static inline uint32_t shm_ring_record(uint32_t len) {
+    return (uint32_t)(sizeof(uint32_t) + len + 7) & ~7u;
+}
+
+/*Bytes published and not released yet*/
+static inline uint32_t shm_ring_used(shm_ring_t *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/*
+Server side: copies a message into the ring and publishes it.
+Returns 1 if it was published, 0 if the ring has no room for it yet and -1 if it can never fit.
+The caller wakes the client when shm_ring_push returns 1 and waiting was set (see shm_ring_take_waiter).
+*/
+static inline int shm_ring_push(shm_ring_t *ring, const void *msg, uint32_t len) {
+    uint32_t record = shm_ring_record(len);
+    if (len > ring->size / 2) return -1;
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t index = head & (ring->size - 1);
+    uint32_t skip = (record > ring->size - index) ? ring->size - index : 0;
+    if (head - tail + skip + record > ring->size) return 0;
+
+    if (skip) {
+        uint32_t wrap = SHM_RING_WRAP;
+        memcpy(ring->data + index, &wrap, sizeof(wrap));
+        index = 0;
+    }
+    memcpy(ring->data + index, &len, sizeof(len));
+    memcpy(ring->data + index + sizeof(len), msg, len);
+    // seq_cst, so the client either sees the new head or is seen waiting
+    atomic_store(&ring->head, head + skip + record);
+    return 1;
+}
+
+/*Server side, after a push: whether the client was sleeping and has to be woken up*/
+static inline int shm_ring_take_waiter(shm_ring_t *ring) {
+    return atomic_exchange(&ring->waiting, 0) != 0;
+}
+
+/*
+Client side: the oldest message, read in place, or NULL if the ring is empty.
+It stays valid until shm_ring_release.
+*/
+static inline const char *shm_ring_peek(shm_ring_t *ring, uint32_t *len) {
+    while (1) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail) return NULL;
+
+        uint32_t index = tail & (ring->size - 1);
+        memcpy(len, ring->data + index, sizeof(*len));
+        if (*len != SHM_RING_WRAP) return ring->data + index + sizeof(*len);
+        atomic_store_explicit(&ring->tail, tail + (ring->size - index), memory_order_release);
+    }
+}
+
+/*Client side: gives the space of the message returned by shm_ring_peek back to the server*/
+static inline void shm_ring_release(shm_ring_t *ring, uint32_t len) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + shm_ring_record(len), memory_order_release);
+}
+
+/*
+Client side, before sleeping on head: announces the wait and returns the head to sleep on,
+or -1 if a message arrived meanwhile.
+*/
+static inline int64_t shm_ring_prepare_wait(shm_ring_t *ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store(&ring->waiting, 1);
+    uint32_t head = atomic_load(&ring->head);
+    if (head != tail) {
+        atomic_store(&ring->waiting, 0);
+        return -1;
+    }
+    return head;
+}
+
+#endif
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE // syscall (shm_ring via frame.h)
+#include "board.h"
+#include "protocol.h"
+#include "frame.h"
+#include "api.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+Benchmark dos transportes server->cliente (FIFO, anel em memoria partilhada e socket SOCK_SEQPACKET).
+O lado do server usa o mesmo enquadramento do update_client (frame_encode/frame_send/frame_flush)
+e cada cliente e um processo que usa a API do cliente (pacman_connect/receive_board_update).
+Cada cliente responde a cada frame com um pacman_play, por isso a latencia e o tempo desde que o
+server comeca a codificar o frame ate receber essa resposta.
+Os resultados saem em CSV, uma linha por transporte, tamanho do board e numero de clientes.
+*/
+
+// Duracao de cada medicao e limites do numero de frames por cliente
+#define BENCH_SECONDS 0.5
+#define BENCH_MIN_FRAMES 10
+#define BENCH_MAX_FRAMES 5000
+
+// Buffer de envio do socket: um frame completo tem de caber num so pacote
+#define BENCH_SNDBUF (4 * 1024 * 1024)
+
+// Fantasmas que se movem no board entre frames
+#define BENCH_GHOSTS 4
+
+static const int bench_sizes[][2] = {{6, 5}, {32, 32}, {128, 128}, {512, 512}, {1024, 1024}};
+static const int bench_clients[] = {1, 4};
+static const struct {
+    int transport;
+    const char *name;
+} bench_transports[] = {{TRANSPORT_FIFO, "fifo"}, {TRANSPORT_SHM, "shm"}, {TRANSPORT_SOCKET, "socket"}};
+
+#define N_ITEMS(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+typedef struct {
+    int x, y;
+    board_pos_t under;  // celula que o actor tapa
+} actor_t;
+
+typedef struct {
+    pid_t pid;
+    int req_rx;
+    int notif_tx;       // igual a req_rx no socket
+    shm_ring_t *ring;
+    frame_out_t out;
+    char in_buf[sizeof(msg_play_t)];
+    size_t in_len;
+    long long sent_ns;  // instante em que se comecou a enviar o frame atual
+    long frames;        // frames ja confirmados pelo cliente
+    int done;           // ja recebeu o board final
+} bench_client_t;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long cpu_ns(int who) {
+    struct rusage ru;
+    getrusage(who, &ru);
+    return ((long long)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+           ((long long)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Board com paredes a volta, pontos no interior e um portal, como um nivel normal
+static void bench_board(board_t *board, int width, int height, actor_t *actors) {
+    memset(board, 0, sizeof(board_t));
+    board->width = width;
+    board->height = height;
+    board->tempo = 1;
+    board->board = calloc((size_t)width * height, sizeof(board_pos_t));
+    if (board->board == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    alloc_layers(board);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            bool border = x == 0 || y == 0 || x == width - 1 || y == height - 1;
+            board_write_cell(board, x, y, border ? CELL_WALL : CELL_DOT);
+        }
+    }
+    board_write_cell(board, width - 2, 1, CELL_PORTAL);
+
+    // O primeiro actor e o pacman (come os pontos), os restantes sao fantasmas
+    for (int i = 0; i <= BENCH_GHOSTS; i++) {
+        actors[i].x = 1 + (i * 3) % (width - 2);
+        actors[i].y = 1 + (i * 2) % (height - 2);
+        actors[i].under = board->board[actors[i].y * width + actors[i].x];
+        board_write_cell(board, actors[i].x, actors[i].y, i == 0 ? CELL_PACMAN : CELL_GHOST);
+    }
+}
+
+// Um passo de jogo: cada actor anda uma posicao para a direita dentro das paredes
+static void bench_step(board_t *board, actor_t *actors) {
+    for (int i = 0; i <= BENCH_GHOSTS; i++) {
+        actor_t *a = &actors[i];
+        int nx = a->x + 1 < board->width - 1 ? a->x + 1 : 1;
+        board_pos_t next = board->board[a->y * board->width + nx];
+        if (cell_content(next) != CELL_EMPTY) continue;
+        board_write_cell(board, a->x, a->y, i == 0 ? CELL_EMPTY : a->under);
+        a->x = nx;
+        a->under = next;
+        board_write_cell(board, a->x, a->y, i == 0 ? CELL_PACMAN : CELL_GHOST);
+    }
+}
+
+// Processo cliente: recebe frames ate ao board final e confirma cada um
+static void run_client(int transport, const char *server_path, int index) {
+    char req[MAX_PIPE_PATH_LENGTH + 1], notif[MAX_PIPE_PATH_LENGTH + 1];
+    snprintf(req, sizeof(req), "/tmp/bench%d_%d_request", (int)getppid(), index);
+    snprintf(notif, sizeof(notif), "/tmp/bench%d_%d_notif", (int)getppid(), index);
+
+    pacman_set_transport(transport);
+    if (pacman_connect(req, notif, server_path) != 0) _exit(EXIT_FAILURE);
+    while (true) {
+        Board board = receive_board_update();
+        if (board.game_over == 2) break;
+        pacman_play('X');
+    }
+    pacman_disconnect();
+    if (transport != TRANSPORT_SOCKET) {
+        unlink(req);
+        unlink(notif);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+// Handshake do lado do server, igual ao do PacmanIST mas bloqueante (um cliente de cada vez)
+static int accept_client(bench_client_t *client, int transport, int reg_fd) {
+    msg_registration_t msg_reg;
+    msg_reg_response_t response;
+    response.op_code = OP_CODE_CONNECT;
+    response.result = 0;
+    response.transport = transport;
+
+    if (transport == TRANSPORT_SOCKET) {
+        int conn = accept(reg_fd, NULL, NULL);
+        if (conn == -1) {
+            perror("[ERR]: accept failed");
+            return -1;
+        }
+        int sndbuf = BENCH_SNDBUF;
+        setsockopt(conn, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        if (recv(conn, &msg_reg, sizeof(msg_reg), 0) != sizeof(msg_reg) ||
+            send(conn, &response, sizeof(response), 0) != sizeof(response)) {
+            perror("[ERR]: socket handshake failed");
+            close(conn);
+            return -1;
+        }
+        client->req_rx = conn;
+        client->notif_tx = conn;
+    } else {
+        if (read(reg_fd, &msg_reg, sizeof(msg_reg)) != sizeof(msg_reg)) {
+            perror("[ERR]: read failed");
+            return -1;
+        }
+        client->req_rx = open(msg_reg.req_pipe_path, O_RDONLY);
+        client->notif_tx = open(msg_reg.notif_pipe_path, O_WRONLY);
+        if (client->req_rx == -1 || client->notif_tx == -1) {
+            perror("[ERR]: open failed");
+            return -1;
+        }
+        if (transport == TRANSPORT_SHM) {
+            client->ring = frame_ring_create(msg_reg.notif_pipe_path);
+            if (client->ring == NULL) return -1;
+        }
+        if (write(client->notif_tx, &response, sizeof(response)) != sizeof(response)) {
+            perror("[ERR]: write failed");
+            return -1;
+        }
+    }
+
+    // Como nas sessoes: nada bloqueia depois do handshake
+    fcntl(client->req_rx, F_SETFL, fcntl(client->req_rx, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(client->notif_tx, F_SETFL, fcntl(client->notif_tx, F_GETFL, 0) | O_NONBLOCK);
+    frame_out_attach(&client->out, client->notif_tx);
+    client->out.mode = FRAME_MODE_GRID;
+    client->out.ring = client->ring;
+    return 0;
+}
+
+static void send_frame(bench_client_t *client, board_t *board, actor_t *actors) {
+    msg_board_update_t header;
+    memset(&header, 0, sizeof(header));
+    header.tempo = board->tempo;
+
+    client->sent_ns = now_ns();
+    bench_step(board, actors);
+    frame_encode(&client->out, board, &header);
+    if (frame_send(&client->out) < 0) {
+        perror("[ERR]: frame_send failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void send_end(bench_client_t *client) {
+    msg_board_update_t header;
+    memset(&header, 0, sizeof(header));
+    header.op_code = OP_CODE_BOARD;
+    header.game_over = 2;
+    if (frame_write(&client->out, &header, sizeof(header)) < 0) {
+        perror("[ERR]: frame_write failed");
+        exit(EXIT_FAILURE);
+    }
+    client->done = 1;
+}
+
+// Le a confirmacao do frame atual; devolve 1 quando chegou inteira
+static int read_ack(bench_client_t *client) {
+    while (client->in_len < sizeof(msg_play_t)) {
+        ssize_t r = read(client->req_rx, client->in_buf + client->in_len, sizeof(msg_play_t) - client->in_len);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("[ERR]: read failed");
+            exit(EXIT_FAILURE);
+        }
+        if (r == 0) {
+            fprintf(stderr, "[ERR]: client closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        client->in_len += (size_t)r;
+    }
+    client->in_len = 0;
+    return 1;
+}
+
+static void run_bench(FILE *out, int transport, const char *transport_name, int width, int height, int n_clients) {
+    char server_path[MAX_PIPE_PATH_LENGTH + 1];
+    int reg_fd;
+    if (transport == TRANSPORT_SOCKET) {
+        snprintf(server_path, sizeof(server_path), "/tmp/bench%d.sock", (int)getpid());
+        unlink(server_path);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, server_path);
+        reg_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (reg_fd == -1 || bind(reg_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(reg_fd, SOMAXCONN) == -1) {
+            perror("[ERR]: socket failed");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        snprintf(server_path, sizeof(server_path), "/tmp/bench%d_reg", (int)getpid());
+        unlink(server_path);
+        if (mkfifo(server_path, 0640) != 0) {
+            perror("[ERR]: mkfifo failed");
+            exit(EXIT_FAILURE);
+        }
+        // Aberto nos dois sentidos: os reads bloqueiam a espera dos registos e nunca veem EOF
+        reg_fd = open(server_path, O_RDWR);
+        if (reg_fd == -1) {
+            perror("[ERR]: open failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bench_client_t *clients = calloc((size_t)n_clients, sizeof(bench_client_t));
+    long long *latencies = malloc(sizeof(long long) * (size_t)n_clients * BENCH_MAX_FRAMES);
+    if (clients == NULL || latencies == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n_clients; i++) {
+        clients[i].pid = fork();
+        if (clients[i].pid == -1) {
+            perror("[ERR]: fork failed");
+            exit(EXIT_FAILURE);
+        }
+        if (clients[i].pid == 0) run_client(transport, server_path, i);
+    }
+    for (int i = 0; i < n_clients; i++) {
+        if (accept_client(&clients[i], transport, reg_fd) == -1) exit(EXIT_FAILURE);
+    }
+
+    board_t board;
+    actor_t actors[BENCH_GHOSTS + 1];
+    bench_board(&board, width, height, actors);
+
+    long long cpu_self = cpu_ns(RUSAGE_SELF);
+    long long cpu_children = cpu_ns(RUSAGE_CHILDREN);
+    long long start = now_ns();
+    long long deadline = start + (long long)(BENCH_SECONDS * 1e9);
+    long n_latencies = 0;
+    int finished = 0;
+
+    for (int i = 0; i < n_clients; i++) send_frame(&clients[i], &board, actors);
+
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * (size_t)n_clients * 2);
+    if (fds == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    while (finished < n_clients) {
+        int n_fds = 0;
+        for (int i = 0; i < n_clients; i++) {
+            if (clients[i].done) continue;
+            fds[n_fds++] = (struct pollfd){.fd = clients[i].req_rx, .events = POLLIN};
+            if (clients[i].out.pending && clients[i].ring == NULL) {
+                fds[n_fds++] = (struct pollfd){.fd = clients[i].notif_tx, .events = POLLOUT};
+            }
+        }
+        // O anel nao tem fd: uma mensagem pendente nele e tentada de novo a cada milissegundo
+        poll(fds, (nfds_t)n_fds, 1);
+
+        for (int i = 0; i < n_clients; i++) {
+            bench_client_t *c = &clients[i];
+            if (c->done) continue;
+            if (c->out.pending && frame_flush(&c->out) < 0) {
+                perror("[ERR]: frame_flush failed");
+                exit(EXIT_FAILURE);
+            }
+            if (!read_ack(c)) continue;
+
+            latencies[n_latencies++] = now_ns() - c->sent_ns;
+            c->frames++;
+            bool more = c->frames < BENCH_MIN_FRAMES || (now_ns() < deadline && c->frames < BENCH_MAX_FRAMES);
+            if (more) {
+                send_frame(c, &board, actors);
+            } else {
+                send_end(c);
+                finished++;
+            }
+        }
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    // Os clientes saem depois de lerem o board final
+    for (int i = 0; i < n_clients; i++) {
+        while (clients[i].out.pending) {
+            if (frame_flush(&clients[i].out) < 0) break;
+            if (clients[i].out.pending) sleep_ms(1);
+        }
+    }
+    for (int i = 0; i < n_clients; i++) waitpid(clients[i].pid, NULL, 0);
+    long long cpu = cpu_ns(RUSAGE_SELF) - cpu_self + cpu_ns(RUSAGE_CHILDREN) - cpu_children;
+
+    long long bytes = 0;
+    for (int i = 0; i < n_clients; i++) {
+        bytes += clients[i].out.bytes;
+        close(clients[i].req_rx);
+        if (clients[i].notif_tx != clients[i].req_rx) close(clients[i].notif_tx);
+        frame_ring_destroy(clients[i].ring);
+    }
+
+    qsort(latencies, (size_t)n_latencies, sizeof(long long), compare_ll);
+    fprintf(out, "%s,%d,%d,%d,%ld,%.3f,%.0f,%.1f,%.1f,%.1f,%.0f\n", transport_name, width, height, n_clients,
+            n_latencies, seconds, n_latencies / seconds,
+            latencies[n_latencies / 2] / 1000.0, latencies[(n_latencies * 99) / 100] / 1000.0,
+            (double)cpu / n_latencies / 1000.0, (double)bytes / n_latencies);
+    fflush(out);
+
+    free(fds);
+    free(latencies);
+    free(clients);
+    free(board.board);
+    free(board.layers);
+    close(reg_fd);
+    unlink(server_path);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [results.csv]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    FILE *out = stdout;
+    if (argc == 2) {
+        out = fopen(argv[1], "w");
+        if (out == NULL) {
+            perror("[ERR]: fopen failed");
+            return EXIT_FAILURE;
+        }
+    }
+    // Um cliente que morra nao pode terminar o benchmark com SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(out, "transport,width,height,clients,frames,seconds,frames_per_sec,"
+                 "latency_p50_us,latency_p99_us,cpu_us_per_frame,bytes_per_frame\n");
+    for (int t = 0; t < N_ITEMS(bench_transports); t++) {
+        for (int s = 0; s < N_ITEMS(bench_sizes); s++) {
+            for (int c = 0; c < N_ITEMS(bench_clients); c++) {
+                fprintf(stderr, "%s %dx%d, %d client(s)\n", bench_transports[t].name,
+                        bench_sizes[s][0], bench_sizes[s][1], bench_clients[c]);
+                run_bench(out, bench_transports[t].transport, bench_transports[t].name,
+                          bench_sizes[s][0], bench_sizes[s][1], bench_clients[c]);
+            }
+        }
+    }
+    if (out != stdout) fclose(out);
+    return EXIT_SUCCESS;
+}
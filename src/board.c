@@ -7,10 +7,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
-#include <pthread.h>
+#include <string.h>
 
 FILE * debugfile;
 
+// Number of bit-planes in a board (walls, portals, dots, pacmans and ghosts)
+#define N_LAYERS 5
+
 // Helper private function to find and kill pacman at specific position
 static int find_and_kill_pacman(board_t* board, int new_x, int new_y) {
     for (int p = 0; p < board->n_pacmans; p++) {
@@ -34,6 +37,55 @@ static inline int is_valid_position(board_t* board, int x, int y) {
     return (x >= 0 && x < board->width) && (y >= 0 && y < board->height); // Inside of the board boundaries
 }
 
+// Helper private function for changing only the occupant of a position (content and charged bits)
+static inline void set_content(board_t* board, int x, int y, int content) {
+    board_pos_t cell = board->board[get_board_index(board, x, y)];
+    board_write_cell(board, x, y, (board_pos_t)((cell & ~(CELL_CONTENT | CELL_CHARGED)) | content));
+}
+
+// Helper private function for checking if a charged ghost must stop at a position
+static inline int blocks_charge(board_t* board, int x, int y) {
+    return bitboard_test(&board->walls, x, y) || bitboard_test(&board->ghost_cells, x, y) ||
+           bitboard_test(&board->pacman_cells, x, y);
+}
+
+// Helper private function: words of row y where a charged ghost stops (walls, ghosts and pacmans)
+// The ghost plane is skipped when the charging ghost is alone in its row
+static inline uint64_t row_blockers(board_t* board, int y, int w, int other_ghosts) {
+    uint64_t bits = bitboard_row(&board->walls, y)[w] | bitboard_row(&board->pacman_cells, y)[w];
+    if (other_ghosts) bits |= bitboard_row(&board->ghost_cells, y)[w];
+    return bits;
+}
+
+// Helper private function: first blocker to the right of x in row y, or -1
+static int next_blocker_right(board_t* board, int x, int y) {
+    int start = x + 1;
+    if (start >= board->width) return -1;
+    int other_ghosts = board_ghosts_in_row(board, y) > 1;
+    int w = start >> 6;
+    uint64_t bits = row_blockers(board, y, w, other_ghosts) & (~0ULL << (start & 63));
+    while (bits == 0) {
+        if (++w >= board->walls.row_words) return -1;
+        bits = row_blockers(board, y, w, other_ghosts);
+    }
+    int found = w * 64 + __builtin_ctzll(bits);
+    return found < board->width ? found : -1;
+}
+
+// Helper private function: first blocker to the left of x in row y, or -1
+static int next_blocker_left(board_t* board, int x, int y) {
+    int start = x - 1;
+    if (start < 0) return -1;
+    int other_ghosts = board_ghosts_in_row(board, y) > 1;
+    int w = start >> 6;
+    uint64_t bits = row_blockers(board, y, w, other_ghosts) & (~0ULL >> (63 - (start & 63)));
+    while (bits == 0) {
+        if (--w < 0) return -1;
+        bits = row_blockers(board, y, w, other_ghosts);
+    }
+    return w * 64 + 63 - __builtin_clzll(bits);
+}
+
 void sleep_ms(int milliseconds) {
     struct timespec ts;
     ts.tv_sec = milliseconds / 1000;
@@ -97,81 +149,38 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
         return INVALID_MOVE;
     }
 
-    int new_index = get_board_index(board, new_x, new_y);
-    int old_index = get_board_index(board, pac->pos_x, pac->pos_y);
-
-    // locks
-    if (old_index < new_index) {
-        pthread_mutex_lock(&board->board[old_index].lock);
-        pthread_mutex_lock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_lock(&board->board[new_index].lock);
-        pthread_mutex_lock(&board->board[old_index].lock);
-    }
-
-    char target_content = board->board[new_index].content;
-
-    if (board->board[new_index].has_portal) {
-        board->board[old_index].content = ' ';
-        board->board[new_index].content = 'P';
+    if (bitboard_test(&board->portals, new_x, new_y)) {
+        set_content(board, pac->pos_x, pac->pos_y, CELL_EMPTY);
+        pac->pos_x = new_x;
+        pac->pos_y = new_y;
+        set_content(board, new_x, new_y, CELL_PACMAN);
         return REACHED_PORTAL;
     }
 
     // Check for walls
-    if (target_content == 'W') {
-        goto move_pacman_invalid;
+    if (bitboard_test(&board->walls, new_x, new_y)) {
+        return INVALID_MOVE;
     }
 
     // Check for ghosts
-    if (target_content == 'M') {
+    if (bitboard_test(&board->ghost_cells, new_x, new_y)) {
         kill_pacman(board, pacman_index);
-        goto move_pacman_dead;
+        return DEAD_PACMAN;
     }
 
     // Collect points
-    if (board->board[new_index].has_dot) {
+    if (bitboard_test(&board->dots, new_x, new_y)) {
         pac->points++;
-        board->board[new_index].has_dot = 0;
+        int new_index = get_board_index(board, new_x, new_y);
+        board_write_cell(board, new_x, new_y, (board_pos_t)(board->board[new_index] & ~CELL_DOT));
     }
 
-    board->board[old_index].content = ' ';
+    set_content(board, pac->pos_x, pac->pos_y, CELL_EMPTY);
     pac->pos_x = new_x;
     pac->pos_y = new_y;
-    board->board[new_index].content = 'P';
+    set_content(board, new_x, new_y, CELL_PACMAN);
 
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    
     return VALID_MOVE;
-
-    move_pacman_invalid:
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    return INVALID_MOVE;
-
-    move_pacman_dead:
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    return DEAD_PACMAN;
 }
 
 int move_ghost_charged(board_t* board, int ghost_index, char direction) {
@@ -183,125 +192,91 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
     int result=0;
 
     ghost->charged = 0; //uncharge
+    set_content(board, x, y, CELL_GHOST);
 
     switch (direction) {
         case 'W':
             if (y == 0) return INVALID_MOVE;
 
-            for (int i = 0; i <= y; i++) {
-                pthread_mutex_lock(&board->board[i * board->width + x].lock);
-            }
-
             new_y = 0; // In case there is no colision
             for (int i = y - 1; i >= 0; i--) {
-                char target_content = board->board[i * board->width + x].content;
-                if (target_content == 'W' || target_content == 'M') {
+                if (!blocks_charge(board, x, i)) continue;
+                if (!bitboard_test(&board->pacman_cells, x, i)) {
                     new_y = i + 1; // stop before colision
                     result = VALID_MOVE;
                     break;
                 }
-                else if (target_content == 'P') {
+                else {
                     new_y = i;
                     result = find_and_kill_pacman(board, new_x, new_y);
                     break;
                 }
             }
-
-            for (int i = 0; i <= y; i++) {
-                pthread_mutex_unlock(&board->board[i * board->width + x].lock);
-            }
             break;
         case 'S':
             if (y == board->height - 1) return INVALID_MOVE;
 
-            for (int i = y; i < board->height; i++) {
-                pthread_mutex_lock(&board->board[i * board->width + x].lock);
-            }
-
             new_y = board->height - 1; // In case there is no colision
             for (int i = y + 1; i < board->height; i++) {
-                char target_content = board->board[i * board->width + x].content;
-                if (target_content == 'W' || target_content == 'M') {
+                if (!blocks_charge(board, x, i)) continue;
+                if (!bitboard_test(&board->pacman_cells, x, i)) {
                     new_y = i - 1; // stop before colision
                     result = VALID_MOVE;
                     break;
                 }
-                else if (target_content == 'P') {
+                else {
                     new_y = i;
                     result = find_and_kill_pacman(board, new_x, new_y);
                     break;
                 }
             }
-
-            for (int i = y; i < board->height; i++) {
-                pthread_mutex_unlock(&board->board[i * board->width + x].lock);
-            }
             break;
         case 'A':
             if (x == 0) return INVALID_MOVE;
 
-            for (int j = 0; j <= x; j++) {
-                pthread_mutex_lock(&board->board[y * board->width + j].lock);
-            }
-
             new_x = 0; // In case there is no colision
-            for (int j = x - 1; j >= 0; j--) {
-                char target_content = board->board[y * board->width + j].content;
-                if (target_content == 'W' || target_content == 'M') {
+            {
+                // Rows are contiguous in the planes, so the first blocker is found a word at a time
+                int j = next_blocker_left(board, x, y);
+                if (j >= 0 && !bitboard_test(&board->pacman_cells, j, y)) {
                     new_x = j + 1; // stop before colision
                     result = VALID_MOVE;
-                    break;
                 }
-                else if (target_content == 'P') {
+                else if (j >= 0) {
                     new_x = j;
                     result = find_and_kill_pacman(board, new_x, new_y);
-                    break;
                 }
             }
-
-            for (int j = 0; j <= x; j++) {
-                pthread_mutex_unlock(&board->board[y * board->width + j].lock);
-            }
             break;
         case 'D':
             if (x == board->width - 1) return INVALID_MOVE;
 
-            for (int j = x; j < board->width; j++) {
-                pthread_mutex_lock(&board->board[y * board->width + j].lock);
-            }
-
             new_x = board->width - 1; // In case there is no colision
-            for (int j = x + 1; j < board->width; j++) {
-                char target_content = board->board[y * board->width + j].content;
-                if (target_content == 'W' || target_content == 'M') {
+            {
+                int j = next_blocker_right(board, x, y);
+                if (j >= 0 && !bitboard_test(&board->pacman_cells, j, y)) {
                     new_x = j - 1; // stop before colision
                     result = VALID_MOVE;
-                    break;
                 }
-                else if (target_content == 'P') {
+                else if (j >= 0) {
                     new_x = j;
                     result = find_and_kill_pacman(board, new_x, new_y);
-                    break;
                 }
             }
-
-            for (int j = x; j < board->width; j++) {
-                pthread_mutex_unlock(&board->board[y * board->width + j].lock);
-            }
             break;
         default:
             debug("DEFAULT CHARGED MOVE - direction = %c\n", direction);
             return INVALID_MOVE;
     }
 
-    board->board[y * board->width + x].content = ' '; // Or restore the dot if ghost was on one
+    set_content(board, x, y, CELL_EMPTY); // Or restore the dot if ghost was on one
 
     // Update ghost position
     ghost->pos_x = new_x;
     ghost->pos_y = new_y;
 
     // Update board - set new position
-    board->board[new_y * board->width + new_x].content = 'M';
+    set_content(board, new_x, new_y, CELL_GHOST);
     return result;
 }
 
@@ -341,6 +316,7 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
         case 'C': // Charge
             ghost->current_move += 1;
             ghost->charged = 1;
+            set_content(board, ghost->pos_x, ghost->pos_y, CELL_GHOST | CELL_CHARGED);
             return VALID_MOVE;
         case 'T': // Wait
             if (command->turns_left == 1) {
@@ -363,35 +339,14 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
         return INVALID_MOVE;
     }
 
-    // Check board position
-    int new_index = new_y * board->width + new_x;
-    int old_index = ghost->pos_y * board->width + ghost->pos_x;
-
-    // locks
-    if (old_index < new_index) {
-        pthread_mutex_lock(&board->board[old_index].lock);
-        pthread_mutex_lock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_lock(&board->board[new_index].lock);
-        pthread_mutex_lock(&board->board[old_index].lock);
-    }
-
-    char target_content = board->board[new_index].content;
-
-    // Check for walls
-    if (target_content == 'W') {
-        goto move_ghost_invalid;
-    }
-
-    // Check for ghosts
-    if (target_content == 'M') {
-        goto move_ghost_invalid;
+    // Check for walls and other ghosts
+    if (bitboard_test(&board->walls, new_x, new_y) || bitboard_test(&board->ghost_cells, new_x, new_y)) {
+        return INVALID_MOVE;
     }
 
     int result = VALID_MOVE;
     // Check for pacman
-    if (target_content == 'P') {
+    if (bitboard_test(&board->pacman_cells, new_x, new_y)) {
         for (int i = 0; i < board->n_pacmans; i++) {
             pacman_t* pac = &board->pacmans[i];
             if (pac->pos_x == new_x && pac->pos_y == new_y && pac->alive) {
@@ -404,43 +359,22 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
     }
 
     // Update board - clear old position (restore what was there)
-    board->board[old_index].content = ' '; // Or restore the dot if ghost was on one
+    set_content(board, ghost->pos_x, ghost->pos_y, CELL_EMPTY); // Or restore the dot if ghost was on one
     // Update ghost position
     ghost->pos_x = new_x;
     ghost->pos_y = new_y;
     // Update board - set new position
-    board->board[new_index].content = 'M';
+    set_content(board, new_x, new_y, CELL_GHOST);
 
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    
     return result;
-
-    move_ghost_invalid:
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    return INVALID_MOVE;
 }
 
 void kill_pacman(board_t* board, int pacman_index) {
     debug("Killing %d pacman\n\n", pacman_index);
     pacman_t* pac = &board->pacmans[pacman_index];
-    int index = pac->pos_y * board->width + pac->pos_x;
 
     // Remove pacman from the board
-    board->board[index].content = ' ';
+    set_content(board, pac->pos_x, pac->pos_y, CELL_EMPTY);
 
     // Mark pacman as dead
     pac->alive = 0;
@@ -448,7 +382,7 @@ void kill_pacman(board_t* board, int pacman_index) {
 
 // Static Loading
 int load_pacman(board_t* board) {
-    board->board[1 * board->width + 1].content = 'P'; // Pacman
+    set_content(board, 1, 1, CELL_PACMAN); // Pacman
     board->pacmans[0].pos_x = 1;
     board->pacmans[0].pos_y = 1;
     board->pacmans[0].alive = 1;
@@ -458,15 +392,65 @@ int load_pacman(board_t* board) {
 
 // Static Loading
 int load_ghost(board_t* board) {
-    board->board[4 * board->width + 8].content = 'M'; // Monster
+    set_content(board, 8, 4, CELL_GHOST); // Monster
     board->ghosts[0].pos_x = 8;
     board->ghosts[0].pos_y = 4;
-    board->board[0 * board->width + 5].content = 'M'; // Monster
+    set_content(board, 5, 0, CELL_GHOST); // Monster
     board->ghosts[1].pos_x = 5;
     board->ghosts[1].pos_y = 0;
     return 0;
 }
 
+size_t layers_size(const board_t* board) {
+    long plane_words = (long)bitboard_row_words(board->width) * board->height;
+    return N_LAYERS * plane_words * sizeof(uint64_t);
+}
+
+void alloc_layers(board_t* board) {
+    uint64_t *layers = calloc(1, layers_size(board));
+    if (layers == NULL){
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    attach_layers(board, layers);
+}
+
+void attach_layers(board_t* board, uint64_t* layers) {
+    int row_words = bitboard_row_words(board->width);
+    long plane_words = (long)row_words * board->height;
+    board->layers = layers;
+
+    bitboard_t *planes[] = {&board->walls, &board->portals, &board->dots, &board->pacman_cells, &board->ghost_cells};
+    for (int i = 0; i < N_LAYERS; i++) {
+        planes[i]->words = board->layers + i * plane_words;
+        planes[i]->row_words = row_words;
+    }
+}
+
+// Sets or clears one bit of a plane
+static inline void write_bit(bitboard_t* plane, int x, int y, int value) {
+    if (value) bitboard_set(plane, x, y);
+    else bitboard_clear(plane, x, y);
+}
+
+void board_write_cell(board_t* board, int x, int y, board_pos_t cell) {
+    board->board[get_board_index(board, x, y)] = cell;
+    int content = cell_content(cell);
+    write_bit(&board->walls, x, y, content == CELL_WALL);
+    write_bit(&board->portals, x, y, cell_has_portal(cell));
+    write_bit(&board->dots, x, y, cell_has_dot(cell));
+    write_bit(&board->pacman_cells, x, y, content == CELL_PACMAN);
+    write_bit(&board->ghost_cells, x, y, content == CELL_GHOST);
+}
+
+int board_dots_left(board_t* board) {
+    return bitboard_count(&board->dots, board->height);
+}
+
+int board_ghosts_in_row(board_t* board, int y) {
+    return bitboard_count_row(&board->ghost_cells, y);
+}
+
 int load_level(board_t *board, char *filename, char* dirname, int points) {
 
     if (read_level(board, filename, dirname) < 0) {
@@ -482,24 +466,38 @@ int load_level(board_t *board, char *filename, char* dirname, int points) {
         printf("Failed to read ghosts\n");
     }
 
-    pthread_rwlock_init(&board->state_lock, NULL);
+    //print_board(board);
+    return 0;
+}
+
+void copy_level(board_t* board, const board_t* level, int accumulated_points) {
+    // Static fields (dimensions, tempo, names) come with the struct, the arrays are duplicated
+    *board = *level;
 
-    for (int i = 0; i < board->height * board->width; i++) {
-        pthread_mutex_init(&board->board[i].lock, NULL);
+    size_t cells = (size_t)level->width * level->height;
+    board->board = malloc(cells * sizeof(board_pos_t));
+    board->pacmans = malloc(level->n_pacmans * sizeof(pacman_t));
+    board->ghosts = malloc((level->n_ghosts > 0 ? level->n_ghosts : 1) * sizeof(ghost_t));
+    if (board->board == NULL || board->pacmans == NULL || board->ghosts == NULL){
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
     }
+    memcpy(board->board, level->board, cells * sizeof(board_pos_t));
+    memcpy(board->pacmans, level->pacmans, level->n_pacmans * sizeof(pacman_t));
+    memcpy(board->ghosts, level->ghosts, level->n_ghosts * sizeof(ghost_t));
 
-    //print_board(board);
-    return 0;
+    // alloc_layers points the planes at the new storage
+    alloc_layers(board);
+    memcpy(board->layers, level->layers, layers_size(board));
+
+    board->pacmans[0].points = accumulated_points;
 }
 
 void unload_level(board_t * board) {
-    pthread_rwlock_destroy(&board->state_lock);
-    for (int i = 0; i < board->height * board->width; i++) {
-        pthread_mutex_destroy(&board->board[i].lock);
-    }
     free(board->board);
     free(board->pacmans);
     free(board->ghosts);
+    free(board->layers);
 }
 
 void open_debug_file(char *filename) {
@@ -550,7 +548,7 @@ void print_board(board_t *board) {
         for (int x = 0; x < board->width; x++) {
             int idx = y * board->width + x;
             if (offset < sizeof(buffer) - 2) {
-                buffer[offset++] = board->board[idx].content;
+                buffer[offset++] = cell_char(board->board[idx]);
             }
         }
         if (offset < sizeof(buffer) - 2) {
@@ -1,28 +1,64 @@
+#define _GNU_SOURCE // syscall
 #include "api.h"
 
 #include <errno.h>
 
 #include "protocol.h"
+#include "shm_ring.h"
 #include "debug.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
 #include <stdlib.h>
 
+// Tempo maximo a dormir no anel antes de verificar se o server fechou o notif pipe
+#define RING_WAIT_MS 100
+
 
 struct Session {
   int id;
   int req_pipe;
-  int notif_pipe;
+  int notif_pipe;       // TRANSPORT_SOCKET: o mesmo socket que req_pipe
+  int packets;          // TRANSPORT_SOCKET: cada mensagem do server chega num pacote
   char req_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
   char notif_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
+  shm_ring_t *ring;   // TRANSPORT_SHM: anel de onde se leem as mensagens do server
+  int holding;        // ha uma mensagem do anel a ser lida no sitio
+  uint32_t held_len;  // tamanho dessa mensagem
 } ;
 
 static struct Session session = {.id = -1};
 
+// Ultimo frame recebido; os deltas do server sao aplicados por cima dele
+struct Frame {
+  char *data;
+  int width;
+  int height;
+  size_t capacity;
+  int valid;        // 0 enquanto nao houver um frame completo para servir de base
+  int resync_pending; // ja foi pedido um frame completo ao server
+  char *patch;      // corpo do ultimo delta ou da ultima lista de entidades
+  size_t patch_capacity;
+  char *layout;     // FRAME_MODE_ENTITIES: paredes, portais e pontos do nivel
+  size_t layout_capacity;
+  char *packet;     // TRANSPORT_SOCKET: ultimo pacote recebido
+  size_t packet_capacity;
+};
+
+static struct Frame frame = {0};
+static int frame_mode = FRAME_MODE_GRID;
+static int transport = TRANSPORT_FIFO;
+
 // Le de um pipe repetidamente (para garantir que leu tudo)
 static int read_msg(int fd, void *buf, size_t n) {
   size_t off = 0;
@@ -60,12 +96,50 @@ static int write_msg(int fd, const void *buf, size_t n) {
   return 0;
 }
 
-int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+void pacman_set_frame_mode(int mode) {
+  frame_mode = mode;
+}
 
-  msg_registration_t msg_registration;
-  msg_registration.op_code = OP_CODE_CONNECT;
-  strcpy(msg_registration.req_pipe_path, req_pipe_path);
-  strcpy(msg_registration.notif_pipe_path, notif_pipe_path);
+void pacman_set_transport(int chosen) {
+  transport = chosen;
+}
+
+// Mapeia o anel criado pelo server para esta sessao
+static int map_ring(const char *notif_pipe_path) {
+  char name[SHM_RING_NAME_LENGTH];
+  shm_ring_name(name, notif_pipe_path);
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    perror("[ERR]: shm_open failed");
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(shm_ring_t)) {
+    perror("[ERR]: fstat failed");
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("[ERR]: mmap failed");
+    return -1;
+  }
+  session.ring = map;
+  if (shm_ring_map_size(session.ring->size) != (size_t)st.st_size) {
+    fprintf(stderr, "[ERR]: invalid ring\n");
+    munmap(map, (size_t)st.st_size);
+    session.ring = NULL;
+    return -1;
+  }
+  // Ja esta mapeado: o nome deixa de ser preciso
+  shm_unlink(name);
+  return 0;
+}
+
+// Cria os FIFOs do cliente, envia o registo pelo FIFO do server e abre os FIFOs
+static int open_fifos(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path,
+                      msg_registration_t *msg_registration) {
   int server;
 
   while (1) {
@@ -103,7 +177,7 @@ int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char
   }
 
   // Envia mensagem de registo para o server
-  int server_write = write_msg(server, &msg_registration, sizeof(msg_registration));
+  int server_write = write_msg(server, msg_registration, sizeof(*msg_registration));
   if (server_write < 0) {
     perror("[ERR]: write failed");
     return -1;
@@ -121,6 +195,67 @@ int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char
     return -1;
   }
 
+  return 0;
+}
+
+// Liga-se ao socket do server e envia o registo como primeiro pacote; o socket serve nos dois sentidos
+static int connect_socket(char const *server_socket_path, msg_registration_t *msg_registration) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(server_socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "[ERR]: socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, server_socket_path);
+
+  int sock;
+  while (1) {
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock == -1) {
+      perror("[ERR]: socket failed");
+      return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) break;
+    close(sock);
+    // Se o server ainda nao esta a escuta
+    if (errno == ENOENT || errno == ECONNREFUSED) {
+      sleep_ms(100);
+      continue;
+    }
+    perror("[ERR]: connect failed");
+    return -1;
+  }
+
+  if (write_msg(sock, msg_registration, sizeof(*msg_registration)) < 0) {
+    perror("[ERR]: write failed");
+    close(sock);
+    return -1;
+  }
+  session.req_pipe = sock;
+  session.notif_pipe = sock;
+  session.packets = 1;
+  return 0;
+}
+
+int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+
+  msg_registration_t msg_registration;
+  memset(&msg_registration, 0, sizeof(msg_registration));
+  msg_registration.op_code = OP_CODE_CONNECT;
+  msg_registration.frame_mode = frame_mode;
+  msg_registration.transport = transport;
+  // Na ligacao por socket o caminho do request pipe so identifica o cliente (nao ha FIFOs)
+  strcpy(msg_registration.req_pipe_path, req_pipe_path);
+  strcpy(msg_registration.notif_pipe_path, notif_pipe_path);
+
+  // TRANSPORT_SOCKET: server_pipe_path e o socket do server
+  if (transport == TRANSPORT_SOCKET) {
+    if (connect_socket(server_pipe_path, &msg_registration) == -1) return -1;
+  } else if (open_fifos(req_pipe_path, notif_pipe_path, server_pipe_path, &msg_registration) == -1) {
+    return -1;
+  }
+
   strcpy(session.notif_pipe_path, notif_pipe_path);
   msg_reg_response_t response;
   int notif_read = read_msg(session.notif_pipe, &response, sizeof(msg_reg_response_t));
@@ -134,6 +269,10 @@ int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char
     if (response.result==1) {
       return -1;
     }
+    // O server criou o anel: as mensagens seguintes vem por la
+    if (response.transport == TRANSPORT_SHM && map_ring(notif_pipe_path) < 0) {
+      return -1;
+    }
     // Correu tudo como esperado
     strcpy(session.req_pipe_path, req_pipe_path);
   }
@@ -162,62 +301,310 @@ int pacman_disconnect() {
     return -1;
   }
   close(session.req_pipe);
-  close(session.notif_pipe);
+  if (session.notif_pipe != session.req_pipe) close(session.notif_pipe);
+  session.packets = 0;
+  if (session.ring != NULL) {
+    munmap(session.ring, shm_ring_map_size(session.ring->size));
+    session.ring = NULL;
+    session.holding = 0;
+  }
+  free(frame.data);
+  free(frame.patch);
+  free(frame.layout);
+  free(frame.packet);
+  memset(&frame, 0, sizeof(frame));
   return 0;
 }
 
-Board   receive_board_update() {
-  msg_board_update_t msg_board;
-  msg_board.op_code = 0;
-  Board game_board;
-  game_board.data = NULL;
+// Garante que um buffer tem pelo menos size bytes
+static void reserve(char **buf, size_t *capacity, size_t size) {
+  if (size <= *capacity) return;
+  free(*buf);
+  *buf = malloc(size);
+  if (*buf == NULL) {
+    perror("[ERR]: Memory Exceeded\n");
+    exit(EXIT_FAILURE);
+  }
+  *capacity = size;
+}
 
-  // Tenta ler o pipe ate ser um board update
-  while (msg_board.op_code != OP_CODE_BOARD) {
-    int notif_read = read_msg(session.notif_pipe, &msg_board, sizeof(msg_board_update_t));
-    if (notif_read == -1) {
-      perror("[ERR]: read failed");
-      exit(EXIT_FAILURE);
+// Pede ao server um frame completo (a base atual deixa de ser valida)
+static void request_resync() {
+  frame.valid = 0;
+  frame.resync_pending = 1;
+  msg_play_t msg_resync;
+  memset(&msg_resync, 0, sizeof(msg_resync));
+  msg_resync.op_code = OP_CODE_RESYNC;
+  if (write_msg(session.req_pipe, &msg_resync, sizeof(msg_play_t)) < 0) {
+    perror("[ERR]: write failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Aplica os spans de um delta ao frame guardado
+// Devolve -1 se o delta nao couber no frame (nesse caso e preciso um resync)
+static int apply_delta(const char *patch, int length, int n_spans) {
+  int pos = 0;
+  int n_cells = frame.width * frame.height;
+  for (int i = 0; i < n_spans; i++) {
+    msg_board_span_t span;
+    if (pos + (int)sizeof(span) > length) return -1;
+    memcpy(&span, patch + pos, sizeof(span));
+    pos += sizeof(span);
+    if (span.offset < 0 || span.length < 0 || span.offset > n_cells - span.length) return -1;
+    if (pos + span.length > length) return -1;
+    memcpy(frame.data + span.offset, patch + pos, (size_t)span.length);
+    pos += span.length;
+  }
+  return 0;
+}
+
+// Reconstroi o board a partir do layout e da lista de entidades
+// Devolve -1 se alguma entidade estiver fora do board
+static int apply_entities(const char *patch, int n_entities, int n_eaten) {
+  int n_cells = frame.width * frame.height;
+
+  // Pontos comidos desde o ultimo frame desaparecem do layout
+  const char *eaten = patch + (size_t)n_entities * sizeof(msg_entity_t);
+  for (int i = 0; i < n_eaten; i++) {
+    int pos;
+    memcpy(&pos, eaten + (size_t)i * sizeof(int), sizeof(int));
+    if (pos < 0 || pos >= n_cells) return -1;
+    frame.layout[pos] = ' ';
+  }
+
+  memcpy(frame.data, frame.layout, (size_t)n_cells);
+  for (int i = 0; i < n_entities; i++) {
+    msg_entity_t entity;
+    memcpy(&entity, patch + (size_t)i * sizeof(msg_entity_t), sizeof(entity));
+    if (!(entity.flags & ENTITY_ALIVE)) continue;
+    if (entity.x < 0 || entity.x >= frame.width || entity.y < 0 || entity.y >= frame.height) return -1;
+    // A primeira entidade e o pacman, as restantes sao fantasmas
+    char c = (i == 0) ? 'C' : ((entity.flags & ENTITY_CHARGED) ? 'G' : 'M');
+    frame.data[entity.y * frame.width + entity.x] = c;
+  }
+  return 0;
+}
+
+// Liberta no anel a mensagem que ja foi tratada
+static void ring_release() {
+  if (session.ring == NULL || !session.holding) return;
+  shm_ring_release(session.ring, session.held_len);
+  session.holding = 0;
+}
+
+// Verifica se o server ja fechou o notif pipe
+static int notif_closed() {
+  struct pollfd pfd = {.fd = session.notif_pipe, .events = POLLIN};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP);
+}
+
+// Espera pela proxima mensagem do anel e devolve-a no sitio, sem a copiar
+// Devolve NULL se o server fechou a ligacao
+static const char *ring_next(uint32_t *len) {
+  while (1) {
+    const char *msg = shm_ring_peek(session.ring, len);
+    if (msg != NULL) {
+      session.holding = 1;
+      session.held_len = *len;
+      return msg;
+    }
+    // So se desiste quando o anel esta vazio: as ultimas mensagens podem chegar antes do fecho
+    if (notif_closed()) {
+      msg = shm_ring_peek(session.ring, len);
+      if (msg == NULL) return NULL;
+      continue;
     }
+    int64_t head = shm_ring_prepare_wait(session.ring);
+    if (head < 0) continue;
+    // Dorme ate o server publicar uma mensagem, acordando de vez em quando para ver se ele ainda existe
+    struct timespec timeout = {0, RING_WAIT_MS * 1000000L};
+    syscall(SYS_futex, &session.ring->head, FUTEX_WAIT, (uint32_t)head, &timeout, NULL, 0);
+    atomic_store(&session.ring->waiting, 0);
+  }
+}
 
-    // Se nao for um board update le de novo
-    if (msg_board.op_code!= OP_CODE_BOARD) continue;
-    int game_over = msg_board.game_over;
+// Recebe o proximo pacote do socket inteiro (um pacote e uma mensagem do server)
+// Devolve NULL se o server fechou a ligacao
+static const char *recv_packet(size_t *len) {
+  while (1) {
+    // MSG_TRUNC devolve o tamanho real do pacote sem o tirar do socket
+    ssize_t size = recv(session.notif_pipe, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    if (size < 0 && errno == EINTR) continue;
+    if (size <= 0) return NULL;
+    reserve(&frame.packet, &frame.packet_capacity, (size_t)size);
+    ssize_t r = recv(session.notif_pipe, frame.packet, (size_t)size, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return NULL;
+    *len = (size_t)r;
+    return frame.packet;
+  }
+}
 
-    // Se nao houver mais niveis, devolve uma board nula com indicaçao de os niveis terem acabado
-    if (game_over==2) {
-      memset(&game_board, 0, sizeof(Board));
-      game_board.game_over = 2;
-      return game_board;
+// Corpo de n bytes da mensagem atual: no anel (ou no pacote) e usado no sitio, do notif pipe e lido para *buf
+static const char *read_body(const char *in_msg, size_t in_msg_len, char **buf, size_t *capacity, size_t n) {
+  if (in_msg != NULL) {
+    if (n > in_msg_len) {
+      fprintf(stderr, "[ERR]: truncated message\n");
+      exit(EXIT_FAILURE);
     }
+    return in_msg;
+  }
+  reserve(buf, capacity, n);
+  if (read_msg(session.notif_pipe, *buf, n) == -1) {
+    perror("[ERR]: read failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return *buf;
+}
 
-    game_board.width = msg_board.width;
-    game_board.height = msg_board.height;
-    int board_dim = game_board.width * game_board.height;
-    game_board.tempo = msg_board.tempo;
-    game_board.victory = msg_board.victory;
-    game_board.game_over = msg_board.game_over;
-    game_board.accumulated_points = msg_board.points;
-    game_board.data = malloc((board_dim)*sizeof(char));
-    if (game_board.data == NULL){
-      perror("[ERR]: Memory Exceeded\n");
+// Copia o corpo de n bytes da mensagem atual para dest
+static void copy_body(const char *in_msg, size_t in_msg_len, char *dest, size_t n) {
+  if (in_msg != NULL) {
+    if (n > in_msg_len) {
+      fprintf(stderr, "[ERR]: truncated message\n");
       exit(EXIT_FAILURE);
     }
+    memcpy(dest, in_msg, n);
+    return;
+  }
+  if (read_msg(session.notif_pipe, dest, n) == -1) {
+    perror("[ERR]: read failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
 
-    // Se o board recebido não for o board nulo de ENDGAME
-    if (game_board.game_over!=2) {
-      // Le os conteudos da board (pacman, monstros, etc...)
-      notif_read = read_msg(session.notif_pipe, game_board.data, (board_dim)*sizeof(char));
+Board receive_board_update() {
+  // Os dois cabecalhos tem o mesmo tamanho, o op_code diz qual deles chegou
+  union {
+    int op_code;
+    msg_board_update_t full;
+    msg_board_delta_t delta;
+    msg_entities_t entities;
+  } msg;
+  Board game_board;
+
+  while (1) {
+    // TRANSPORT_SHM: a mensagem e lida diretamente do anel e so e libertada depois de tratada
+    ring_release();
+    const char *body = NULL;
+    size_t body_len = 0;
+    if (session.ring != NULL) {
+      uint32_t len;
+      const char *in_ring = ring_next(&len);
+      if (in_ring == NULL) {
+        fprintf(stderr, "[ERR]: server closed the connection\n");
+        exit(EXIT_FAILURE);
+      }
+      if (len < sizeof(msg_board_update_t)) continue;
+      memcpy(&msg, in_ring, sizeof(msg_board_update_t));
+      body = in_ring + sizeof(msg_board_update_t);
+      body_len = len - sizeof(msg_board_update_t);
+    } else if (session.packets) {
+      // TRANSPORT_SOCKET: o pacote traz a mensagem inteira, que e lida no buffer do pacote
+      size_t len;
+      const char *packet = recv_packet(&len);
+      if (packet == NULL) {
+        fprintf(stderr, "[ERR]: server closed the connection\n");
+        exit(EXIT_FAILURE);
+      }
+      if (len < sizeof(msg_board_update_t)) continue;
+      memcpy(&msg, packet, sizeof(msg_board_update_t));
+      body = packet + sizeof(msg_board_update_t);
+      body_len = len - sizeof(msg_board_update_t);
+    } else {
+      int notif_read = read_msg(session.notif_pipe, &msg, sizeof(msg_board_update_t));
       if (notif_read == -1) {
-        free(game_board.data);
-        perror("[ERR]: read failed\n");
+        perror("[ERR]: read failed");
         exit(EXIT_FAILURE);
       }
+    }
+
+    if (msg.op_code == OP_CODE_BOARD) {
+      // Se nao houver mais niveis, devolve uma board nula com indicaçao de os niveis terem acabado
+      if (msg.full.game_over == 2) {
+        ring_release();
+        memset(&game_board, 0, sizeof(Board));
+        game_board.game_over = 2;
+        return game_board;
+      }
+
+      // Frame completo: passa a ser a nova base
+      size_t board_dim = (size_t)msg.full.width * (size_t)msg.full.height;
+      reserve(&frame.data, &frame.capacity, board_dim);
+      copy_body(body, body_len, frame.data, board_dim);
+      frame.width = msg.full.width;
+      frame.height = msg.full.height;
+      frame.valid = 1;
+      frame.resync_pending = 0;
+
+      game_board.tempo = msg.full.tempo;
+      game_board.victory = msg.full.victory;
+      game_board.game_over = msg.full.game_over;
+      game_board.accumulated_points = msg.full.points;
+    } else if (msg.op_code == OP_CODE_BOARD_DELTA) {
+      if (msg.delta.length < 0) {
+        fprintf(stderr, "[ERR]: invalid board delta\n");
+        exit(EXIT_FAILURE);
+      }
+      const char *patch = read_body(body, body_len, &frame.patch, &frame.patch_capacity, (size_t)msg.delta.length);
+      // Sem base (ou com um delta que nao lhe corresponde) espera pelo proximo frame completo
+      if (!frame.valid) {
+        if (!frame.resync_pending) request_resync();
+        continue;
+      }
+      if (apply_delta(patch, msg.delta.length, msg.delta.n_spans) < 0) {
+        request_resync();
+        continue;
+      }
+
+      game_board.tempo = msg.delta.tempo;
+      game_board.victory = msg.delta.victory;
+      game_board.game_over = msg.delta.game_over;
+      game_board.accumulated_points = msg.delta.points;
+    } else if (msg.op_code == OP_CODE_LAYOUT) {
+      // Layout do nivel: os frames seguintes so trazem as entidades
+      size_t board_dim = (size_t)msg.full.width * (size_t)msg.full.height;
+      reserve(&frame.layout, &frame.layout_capacity, board_dim);
+      reserve(&frame.data, &frame.capacity, board_dim);
+      copy_body(body, body_len, frame.layout, board_dim);
+      frame.width = msg.full.width;
+      frame.height = msg.full.height;
+      frame.valid = 1;
+      frame.resync_pending = 0;
+      continue;
+    } else if (msg.op_code == OP_CODE_ENTITIES) {
+      if (msg.entities.n_entities < 0 || msg.entities.n_eaten < 0) {
+        fprintf(stderr, "[ERR]: invalid entity list\n");
+        exit(EXIT_FAILURE);
+      }
+      size_t length = (size_t)msg.entities.n_entities * sizeof(msg_entity_t) +
+                      (size_t)msg.entities.n_eaten * sizeof(int);
+      const char *patch = read_body(body, body_len, &frame.patch, &frame.patch_capacity, length);
+      // Sem layout nao ha onde colocar as entidades
+      if (!frame.valid) {
+        if (!frame.resync_pending) request_resync();
+        continue;
+      }
+      if (apply_entities(patch, msg.entities.n_entities, msg.entities.n_eaten) < 0) {
+        request_resync();
+        continue;
+      }
+
+      game_board.tempo = msg.entities.tempo;
+      game_board.victory = msg.entities.victory;
+      game_board.game_over = msg.entities.game_over;
+      game_board.accumulated_points = msg.entities.points;
     } else {
-      game_board.data = NULL;
+      // Se nao for um board update le de novo
+      continue;
     }
+
+    // O board devolvido esta em frame.data, por isso a mensagem ja pode voltar ao server
+    ring_release();
+    game_board.width = frame.width;
+    game_board.height = frame.height;
+    game_board.data = frame.data;
     return game_board;
   }
-  free(game_board.data);
-  exit(EXIT_FAILURE);
-}
\ No newline at end of file
+}
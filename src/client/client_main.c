@@ -8,6 +8,7 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <string.h>
 
 Board board;
 bool stop_execution = false;
@@ -34,10 +35,8 @@ static void *receiver_thread(void *arg) {
 
         draw_board_client(board);
         refresh_screen();
-        free(board.data);
     }
 
-    free(board.data);
     debug("Returning receiver thread...\n");
     return NULL;
 }
@@ -75,6 +74,21 @@ int main(int argc, char *argv[]) {
 
     open_debug_file("client-debug.log");
 
+    // PACMAN_FRAME_MODE=entities pede ao server so as posicoes das entidades em cada frame
+    const char *frame_mode = getenv("PACMAN_FRAME_MODE");
+    if (frame_mode && strcmp(frame_mode, "entities") == 0) {
+        pacman_set_frame_mode(FRAME_MODE_ENTITIES);
+    }
+    // PACMAN_TRANSPORT=shm pede ao server que envie as mensagens por um anel em memoria partilhada
+    const char *transport = getenv("PACMAN_TRANSPORT");
+    if (transport && strcmp(transport, "shm") == 0) {
+        pacman_set_transport(TRANSPORT_SHM);
+    }
+    // PACMAN_TRANSPORT=socket liga-se ao socket do server, dado no lugar do register_pipe
+    if (transport && strcmp(transport, "socket") == 0) {
+        pacman_set_transport(TRANSPORT_SOCKET);
+    }
+
     if (pacman_connect(req_pipe_path, notif_pipe_path, register_pipe) != 0) {
         // Se o cliente for incapaz de se conectar
         perror("[ERR] Failed to connect to server\n");
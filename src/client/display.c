@@ -138,55 +138,8 @@ char* get_board_displayed(board_t* board) {
         exit(EXIT_FAILURE);
     }
     size_t pos = 0;
-    for (int y = 0; y < board->height; y++) {
-        for (int x = 0; x < board->width; x++) {
-            int index = y * board->width + x;
-            char ch = board->board[index].content;
-            int ghost_charged = 0;
-
-            for (int g = 0; g < board->n_ghosts; g++) {
-                ghost_t* ghost = &board->ghosts[g];
-                if (ghost->pos_x == x && ghost->pos_y == y) {
-                    if (ghost->charged)
-                        ghost_charged = 1;
-                    break;
-                }
-            }
-
-            // Draw with appropriate character
-            switch (ch) {
-                case 'W': // Wall
-                    output[pos++] = '#';
-                    break;
-
-                case 'P': // Pacman
-                    output[pos++] = 'C';
-                    break;
-
-                case 'M': // Monster/Ghost
-                    if (ghost_charged) {
-                        output[pos++] = 'G'; 
-                    } else {
-                        output[pos++] = 'M';
-                    }
-                    break;
-
-                case ' ': // Empty space
-                    if (board->board[index].has_portal) {
-                        output[pos++] = '@';
-                    }
-                    else if (board->board[index].has_dot) {
-                        output[pos++] = '.';
-                    }
-                    else
-                        output[pos++] = ' ';
-                    break;
-
-                default:
-                    output[pos++] = ch;
-                    break;
-            }
-        }
+    for (int index = 0; index < board->width * board->height; index++) {
+        output[pos++] = cell_frame_char(board->board[index]);
     }
     
     output[pos] = '\0';
@@ -222,17 +175,8 @@ void draw_board(board_t* board, int mode) {
     for (int y = 0; y < board->height; y++) {
         for (int x = 0; x < board->width; x++) {
             int index = y * board->width + x;
-            char ch = board->board[index].content;
-            int ghost_charged = 0;
-
-            for (int g = 0; g < board->n_ghosts; g++) {
-                ghost_t* ghost = &board->ghosts[g];
-                if (ghost->pos_x == x && ghost->pos_y == y) {
-                    if (ghost->charged)
-                        ghost_charged = 1;
-                    break;
-                }
-            }
+            char ch = cell_char(board->board[index]);
+            int ghost_charged = cell_is_charged(board->board[index]);
 
             // Move cursor to position
             move(start_row + y, x);
@@ -258,12 +202,12 @@ void draw_board(board_t* board, int mode) {
                     break;
 
                 case ' ': // Empty space
-                    if (board->board[index].has_portal) {
+                    if (cell_has_portal(board->board[index])) {
                         attron(COLOR_PAIR(6));
                         addch('@');
                         attroff(COLOR_PAIR(6));
                     }
-                    else if (board->board[index].has_dot) {
+                    else if (cell_has_dot(board->board[index])) {
                         attron(COLOR_PAIR(4));
                         addch('.');
                         attroff(COLOR_PAIR(4));
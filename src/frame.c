@@ -0,0 +1,495 @@
+#define _GNU_SOURCE // vmsplice, syscall
+#include "frame.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// Celulas iguais que podem ficar dentro de um span (mais barato do que abrir um span novo)
+#define SPAN_MAX_GAP ((int)sizeof(msg_board_span_t))
+
+// Converte o board numa string para ser enviado para o client
+// Cada celula guarda tudo o que e preciso (incluindo se o fantasma esta carregado),
+// por isso basta uma passagem linear com uma consulta a tabela por posicao
+void board_to_char(board_t *board, char* char_board) {
+    int n_cells = board->width * board->height;
+    for (int idx = 0; idx < n_cells; idx++) {
+        char_board[idx] = cell_frame_char(board->board[idx]);
+    }
+}
+
+void frame_out_reset(frame_out_t *out) {
+    out->layout_sent = false;
+    out->sent_width = 0;
+    out->sent_height = 0;
+    out->since_keyframe = 0;
+    out->resync = false;
+    out->frames = 0;
+    out->keyframes = 0;
+    out->dropped = 0;
+    out->bytes = 0;
+}
+
+static size_t page_size(void) {
+    static size_t size = 0;
+    if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// Mapeia um buffer com uma pagina para o cabecalho seguida de espaco para n_cells celulas
+static void buf_map(frame_buf_t *buf, size_t n_cells) {
+    size_t page = page_size();
+    size_t size = page + (n_cells + page - 1) / page * page;
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    buf->cells = base + page;
+    buf->map_size = size;
+    buf->busy_until = 0;
+}
+
+static void buf_unmap(frame_buf_t *buf) {
+    if (buf->map_size == 0) return;
+    // Paginas ainda presas num pipe (vmsplice) so sao libertadas quando o cliente as ler
+    munmap(buf->cells - page_size(), buf->map_size);
+    buf->cells = NULL;
+    buf->map_size = 0;
+    buf->busy_until = 0;
+}
+
+int frame_unread(frame_out_t *out) {
+    if (out->ring != NULL) return (int)shm_ring_used(out->ring);
+    int unread;
+    // Num socket Unix, SIOCOUTQ conta os pacotes enviados que o cliente ainda nao recebeu
+    if (ioctl(out->fd, out->is_socket ? SIOCOUTQ : FIONREAD, &unread) == -1) return -1;
+    return unread;
+}
+
+// Bytes que o cliente ja leu do pipe
+static long long stream_consumed(frame_out_t *out) {
+    int unread = frame_unread(out);
+    if (unread < 0) return 0; // na duvida, nada foi lido
+    return out->stream_pos - unread;
+}
+
+// Garante que o buffer pode ser reescrito: se as paginas ainda estao no pipe, troca-as por outras
+static void buf_claim(frame_out_t *out, frame_buf_t *buf) {
+    if (buf->busy_until == 0) return;
+    if (buf->busy_until > stream_consumed(out)) {
+        size_t cells = buf->map_size - page_size();
+        buf_unmap(buf);
+        buf_map(buf, cells);
+    }
+    buf->busy_until = 0;
+}
+
+void frame_out_attach(frame_out_t *out, int fd) {
+    // Paginas entregues ao pipe do cliente anterior podem ainda nao ter sido lidas
+    if (out->frame.busy_until || out->sent.busy_until) {
+        buf_unmap(&out->frame);
+        buf_unmap(&out->sent);
+        out->capacity = 0;
+    }
+    out->fd = fd;
+    out->ring = NULL;
+    // vmsplice so funciona com pipes; num socket cada write ja e um pacote inteiro
+    struct stat st;
+    out->is_socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    out->no_splice = out->is_socket;
+    out->pending = false;
+    out->stream_pos = 0;
+    frame_out_reset(out);
+}
+
+// Garante que os buffers tem espaco para um frame com n_cells celulas
+static void frame_reserve(frame_out_t *out, size_t n_cells) {
+    if (n_cells <= out->capacity) return;
+
+    // O frame enviado deixa de servir de base
+    buf_unmap(&out->frame);
+    buf_unmap(&out->sent);
+    buf_map(&out->frame, n_cells);
+    buf_map(&out->sent, n_cells);
+    out->capacity = out->frame.map_size - page_size();
+    out->sent_width = 0;
+    out->sent_height = 0;
+}
+
+// Garante que a mensagem a enviar cabe em tx
+static void tx_reserve(frame_out_t *out, size_t size) {
+    if (size <= out->tx_capacity) return;
+    free(out->tx);
+    out->tx = malloc(size);
+    if (out->tx == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    out->tx_capacity = size;
+}
+
+static inline uint64_t load_word(const char *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+// Escreve em tx os spans de celulas diferentes entre cur e prev
+// Devolve o tamanho do corpo, ou -1 se ficar maior do que limit (nesse caso compensa mandar o frame inteiro)
+static long encode_spans(const char *cur, const char *prev, int n, char *tx, size_t limit, int *n_spans) {
+    size_t pos = 0;
+    int i = 0;
+    *n_spans = 0;
+
+    while (i < n) {
+        // Salta 8 celulas de cada vez enquanto forem iguais
+        while (i + 8 <= n && load_word(cur + i) == load_word(prev + i)) i += 8;
+        if (i >= n) break;
+        if (cur[i] == prev[i]) {
+            i++;
+            continue;
+        }
+
+        // Estende o span enquanto as falhas entre celulas alteradas forem curtas
+        int start = i;
+        int end = i + 1;
+        for (int j = end; j < n && j - end < SPAN_MAX_GAP; j++) {
+            if (cur[j] != prev[j]) end = j + 1;
+        }
+
+        msg_board_span_t span = { .offset = start, .length = end - start };
+        if (pos + sizeof(span) + (size_t)span.length >= limit) return -1;
+        memcpy(tx + pos, &span, sizeof(span));
+        memcpy(tx + pos + sizeof(span), cur + start, (size_t)span.length);
+        pos += sizeof(span) + (size_t)span.length;
+        (*n_spans)++;
+        i = end;
+    }
+    return (long)pos;
+}
+
+// Caracter do layout de uma celula: so paredes, portais e pontos
+static inline char layout_char(board_pos_t cell) {
+    if (cell_content(cell) == CELL_WALL) return cell_frame_char(CELL_WALL);
+    return cell_frame_char((board_pos_t)(cell & (CELL_DOT | CELL_PORTAL)));
+}
+
+// FRAME_MODE_ENTITIES: layout (se o cliente ainda nao o tem), posicoes das entidades e pontos comidos
+static void encode_entities(frame_out_t *out, board_t *board, const msg_board_update_t *header) {
+    int n_cells = board->width * board->height;
+    size_t plane_words = (size_t)board->dots.row_words * (size_t)board->height;
+    bool layout = !out->layout_sent || out->resync ||
+                  out->sent_width != board->width || out->sent_height != board->height;
+
+    if (plane_words > out->dots_capacity) {
+        free(out->sent_dots);
+        out->sent_dots = malloc(plane_words * sizeof(uint64_t));
+        if (out->sent_dots == NULL) {
+            perror("Memory Exceeded");
+            exit(EXIT_FAILURE);
+        }
+        out->dots_capacity = plane_words;
+        layout = true;
+    }
+
+    // Os pontos comidos sao os que estavam no plano enviado e ja nao estao no atual
+    int n_eaten = 0;
+    if (!layout) {
+        for (size_t w = 0; w < plane_words; w++) {
+            n_eaten += __builtin_popcountll(out->sent_dots[w] & ~board->dots.words[w]);
+        }
+        // Uma lista de pontos comidos maior do que o layout da lugar ao layout,
+        // para nenhuma mensagem passar de frame_max_size
+        if ((size_t)n_eaten * sizeof(int) > sizeof(msg_board_update_t) + (size_t)n_cells) {
+            layout = true;
+            n_eaten = 0;
+        }
+    }
+    int n_entities = board->n_pacmans + board->n_ghosts;
+
+    size_t size = sizeof(msg_entities_t) + (size_t)n_entities * sizeof(msg_entity_t) + (size_t)n_eaten * sizeof(int);
+    if (layout) size += sizeof(msg_board_update_t) + (size_t)n_cells;
+    tx_reserve(out, size);
+    char *p = out->tx;
+
+    if (layout) {
+        msg_board_update_t msg = *header;
+        msg.op_code = OP_CODE_LAYOUT;
+        msg.width = board->width;
+        msg.height = board->height;
+        memcpy(p, &msg, sizeof(msg));
+        p += sizeof(msg);
+        for (int idx = 0; idx < n_cells; idx++) {
+            p[idx] = layout_char(board->board[idx]);
+        }
+        p += n_cells;
+        out->layout_sent = true;
+        out->resync = false;
+        out->keyframes++;
+    }
+
+    msg_entities_t entities;
+    entities.op_code = OP_CODE_ENTITIES;
+    entities.tempo = header->tempo;
+    entities.victory = header->victory;
+    entities.game_over = header->game_over;
+    entities.points = header->points;
+    entities.n_entities = n_entities;
+    entities.n_eaten = n_eaten;
+    memcpy(p, &entities, sizeof(entities));
+    p += sizeof(entities);
+
+    for (int i = 0; i < board->n_pacmans; i++) {
+        pacman_t *pac = &board->pacmans[i];
+        msg_entity_t entity = { .x = pac->pos_x, .y = pac->pos_y, .flags = pac->alive ? ENTITY_ALIVE : 0 };
+        memcpy(p, &entity, sizeof(entity));
+        p += sizeof(entity);
+    }
+    for (int i = 0; i < board->n_ghosts; i++) {
+        ghost_t *ghost = &board->ghosts[i];
+        msg_entity_t entity = { .x = ghost->pos_x, .y = ghost->pos_y,
+                                .flags = ENTITY_ALIVE | (ghost->charged ? ENTITY_CHARGED : 0) };
+        memcpy(p, &entity, sizeof(entity));
+        p += sizeof(entity);
+    }
+
+    // Percorre os bits apagados palavra a palavra
+    if (n_eaten > 0) {
+        int row_words = board->dots.row_words;
+        for (size_t w = 0; w < plane_words; w++) {
+            uint64_t eaten = out->sent_dots[w] & ~board->dots.words[w];
+            while (eaten) {
+                int x = (int)(w % (size_t)row_words) * 64 + __builtin_ctzll(eaten);
+                int y = (int)(w / (size_t)row_words);
+                int pos = y * board->width + x;
+                memcpy(p, &pos, sizeof(int));
+                p += sizeof(int);
+                eaten &= eaten - 1;
+            }
+        }
+    }
+
+    // O plano de pontos passa a ser o que o cliente conhece
+    memcpy(out->sent_dots, board->dots.words, plane_words * sizeof(uint64_t));
+    out->frame_width = board->width;
+    out->frame_height = board->height;
+    out->msg = out->tx;
+    out->msg_len = (size_t)(p - out->tx);
+    out->msg_in_frame = false;
+}
+
+void frame_encode(frame_out_t *out, board_t *board, const msg_board_update_t *header) {
+    if (out->mode == FRAME_MODE_ENTITIES) {
+        encode_entities(out, board, header);
+        return;
+    }
+
+    int n_cells = board->width * board->height;
+    frame_reserve(out, (size_t)n_cells);
+    buf_claim(out, &out->frame);
+    char *frame = out->frame.cells;
+    board_to_char(board, frame);
+    out->frame_width = board->width;
+    out->frame_height = board->height;
+
+    bool keyframe = out->resync || out->since_keyframe >= KEYFRAME_INTERVAL ||
+                    out->sent_width != board->width || out->sent_height != board->height;
+
+    if (!keyframe) {
+        int n_spans;
+        // Um delta so compensa se for mais pequeno do que o frame inteiro
+        tx_reserve(out, sizeof(msg_board_delta_t) + (size_t)n_cells);
+        long length = encode_spans(frame, out->sent.cells, n_cells, out->tx + sizeof(msg_board_delta_t),
+                                   (size_t)n_cells, &n_spans);
+        if (length >= 0) {
+            msg_board_delta_t delta;
+            delta.op_code = OP_CODE_BOARD_DELTA;
+            delta.tempo = header->tempo;
+            delta.victory = header->victory;
+            delta.game_over = header->game_over;
+            delta.points = header->points;
+            delta.n_spans = n_spans;
+            delta.length = (int)length;
+            memcpy(out->tx, &delta, sizeof(delta));
+            out->since_keyframe++;
+            out->msg = out->tx;
+            out->msg_len = sizeof(delta) + (size_t)length;
+            out->msg_in_frame = false;
+            return;
+        }
+    }
+
+    // O cabecalho fica mesmo antes das celulas, na pagina reservada para isso
+    msg_board_update_t msg = *header;
+    msg.op_code = OP_CODE_BOARD;
+    msg.width = board->width;
+    msg.height = board->height;
+    memcpy(frame - sizeof(msg), &msg, sizeof(msg));
+    out->since_keyframe = 0;
+    out->resync = false;
+    out->keyframes++;
+    out->msg = frame - sizeof(msg);
+    out->msg_len = sizeof(msg) + (size_t)n_cells;
+    out->msg_in_frame = true;
+}
+
+size_t frame_max_size(int mode, int width, int height, int n_entities) {
+    // Frame completo (os deltas so sao usados quando sao mais pequenos do que ele)
+    size_t size = sizeof(msg_board_update_t) + (size_t)width * height;
+    if (mode == FRAME_MODE_ENTITIES) {
+        // Layout seguido das entidades
+        size += sizeof(msg_entities_t) + (size_t)n_entities * sizeof(msg_entity_t);
+    }
+    return size;
+}
+
+shm_ring_t *frame_ring_create(const char *notif_pipe_path) {
+    char name[SHM_RING_NAME_LENGTH];
+    shm_ring_name(name, notif_pipe_path);
+
+    // Um segmento deixado por um cliente anterior com o mesmo pipe e substituido
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) {
+        perror("[ERR]: shm_open failed");
+        return NULL;
+    }
+    size_t map_size = shm_ring_map_size(SHM_RING_SIZE);
+    if (ftruncate(fd, (off_t)map_size) == -1) {
+        perror("[ERR]: ftruncate failed");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    // As paginas do anel so ocupam memoria quando sao escritas pela primeira vez
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("[ERR]: mmap failed");
+        shm_unlink(name);
+        return NULL;
+    }
+
+    shm_ring_t *ring = map;
+    ring->size = SHM_RING_SIZE;
+    strcpy(ring->name, name);
+    return ring;
+}
+
+void frame_ring_destroy(shm_ring_t *ring) {
+    if (ring == NULL) return;
+    // O cliente apaga o nome assim que mapeia o anel; aqui so falta se ele nunca chegou a faze-lo
+    shm_unlink(ring->name);
+    munmap(ring, shm_ring_map_size(ring->size));
+}
+
+// Verifica se o cliente fechou o notif pipe (o anel nunca mais vai ser esvaziado)
+static bool client_gone(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLERR | POLLHUP));
+}
+
+// Publica a mensagem no anel de memoria partilhada e acorda o cliente se ele estiver a dormir
+static int ring_flush(frame_out_t *out) {
+    int pushed = shm_ring_push(out->ring, out->msg, (uint32_t)out->msg_len);
+    if (pushed < 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (pushed == 0) {
+        if (client_gone(out->fd)) {
+            errno = EPIPE;
+            return -1;
+        }
+        return 0;
+    }
+    if (shm_ring_take_waiter(out->ring)) {
+        syscall(SYS_futex, &out->ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    out->msg_off = out->msg_len;
+    out->stream_pos += (long long)out->msg_len;
+    out->pending = false;
+    return 1;
+}
+
+int frame_flush(frame_out_t *out) {
+    // No anel a mensagem entra toda de uma vez ou fica pendente
+    if (out->ring != NULL && out->pending) return ring_flush(out);
+
+    while (out->pending) {
+        size_t left = out->msg_len - out->msg_off;
+        ssize_t w;
+        if (out->msg_spliced) {
+            // Entrega as paginas ao pipe sem as copiar
+            struct iovec iov = { .iov_base = (void *)(out->msg + out->msg_off), .iov_len = left };
+            w = vmsplice(out->fd, &iov, 1, SPLICE_F_NONBLOCK);
+        } else {
+            w = write(out->fd, out->msg + out->msg_off, left);
+        }
+        if (w < 0) {
+            // Se foi interrompido por sinal, tenta novamente
+            if (errno == EINTR) continue;
+            // Pipe cheio: o resto segue quando o cliente ler
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            // O fd nao aceita vmsplice: passa a usar write
+            if (out->msg_spliced && errno == EINVAL && out->msg_off == 0) {
+                out->no_splice = true;
+                out->msg_spliced = false;
+                continue;
+            }
+            return -1;
+        }
+        out->msg_off += (size_t)w;
+        out->stream_pos += (long long)w;
+        if (out->msg_off == out->msg_len) out->pending = false;
+    }
+    return 1;
+}
+
+// Comeca a escrever a mensagem atual
+static int start_msg(frame_out_t *out) {
+    out->msg_off = 0;
+    out->pending = out->msg_len > 0;
+    return frame_flush(out);
+}
+
+int frame_write(frame_out_t *out, const void *buf, size_t len) {
+    tx_reserve(out, len);
+    memcpy(out->tx, buf, len);
+    out->msg = out->tx;
+    out->msg_len = len;
+    out->msg_in_frame = false;
+    out->msg_spliced = false;
+    return start_msg(out);
+}
+
+int frame_send(frame_out_t *out) {
+    out->msg_spliced = out->msg_in_frame && out->ring == NULL && !out->no_splice &&
+                       out->msg_len >= VMSPLICE_MIN_BYTES;
+    // O pipe fica com referencias as paginas ate o cliente as ler
+    if (out->msg_spliced) out->frame.busy_until = out->stream_pos + (long long)out->msg_len;
+
+    // A mensagem vai ser escrita ate ao fim, por isso ja passa a ser a base do proximo delta
+    if (out->mode == FRAME_MODE_GRID) {
+        frame_buf_t sent = out->sent;
+        out->sent = out->frame;
+        out->frame = sent;
+    }
+    out->sent_width = out->frame_width;
+    out->sent_height = out->frame_height;
+    out->frames++;
+    out->bytes += (long long)out->msg_len;
+    return start_msg(out);
+}
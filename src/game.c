@@ -2,18 +2,24 @@
 #include "display.h"
 #include "debug.h"
 #include "protocol.h"
+#include "scheduler.h"
+#include "frame.h"
+#include "level.h"
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <bits/posix2_lim.h>
 
 
@@ -29,59 +35,265 @@
 #define GAMEOVER 2
 #define ENDGAME 3
 
+// Intervalo entre verificacoes do pedido de disconnect no fim do jogo
+#define DISCONNECT_POLL_MS 100
+
+// Maximo de ticks entre frames para um cliente que le devagar
+#define FRAME_INTERVAL_MAX 16
+
+// Jogadas lidas do req pipe a espera de que o pacman possa agir
+#define PLAY_QUEUE_SIZE 16
+
+// O nivel seguinte so e copiado depois destes ticks, para nao atrasar o arranque do nivel atual
+#define PREFETCH_DELAY_TICKS 8
+
+// Intervalo entre tentativas de acabar de escrever uma mensagem que tem de chegar ao cliente
+#define FLUSH_RETRY_MS 10
+
+// Intervalo entre tentativas de abrir os pipes de um cliente durante o handshake
+#define HANDSHAKE_RETRY_MS 10
+// Tempo maximo que um cliente pode demorar a abrir os seus pipes
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define HANDSHAKES_INITIAL_CAPACITY 16
+
+// Buffer de envio pedido para cada ligacao por socket: um frame completo tem de caber num so pacote
+// O kernel limita-o a net.core.wmem_max, por isso o tamanho obtido e verificado no connect
+#define SOCKET_SNDBUF (4 * 1024 * 1024)
+// Bytes do buffer de envio que um pacote SOCK_SEQPACKET nao pode usar
+#define SOCKET_PACKET_OVERHEAD 32
+
+// Numero de clientes que podem estar na fila a espera de uma sessao (potencia de 2)
+#define REGISTRATION_QUEUE_SIZE 1024
+
 // Numero de clients a mostrar na leaderboard
 #define LEADERBOARD_SIZE 5
 
+// Fases de uma sessao (cada passo do scheduler corre a fase atual)
+typedef enum {
+    SESSION_CONNECT,        // Falta responder ao pedido de ligacao
+    SESSION_LEVEL_START,    // Falta carregar o proximo nivel
+    SESSION_PLAYING,        // A jogar um nivel, um tick por passo
+    SESSION_LEVEL_END,      // Falta enviar o resultado do nivel
+    SESSION_GAME_END,       // Falta enviar o board final
+    SESSION_WAIT_DISCONNECT // A espera do pedido de disconnect
+} session_phase_t;
+
 typedef struct {
     int id;             // Id do cliente da sessao
-    int *points;        // Ponteiro para os pontos atuais do cliente
+    _Atomic int score;  // Pontos atuais do cliente, publicados pela tarefa da sessao para a leaderboard
     bool active;        // Identifica se a sessao está ativa ou nao (se o cliente ainda esta conectado ou nao)
     int notif_tx;
     int req_rx;
-    int thread_shutdown;// Flag para indicar às threads para terminarem
     int error;          // Flag para indicar à session que ocorreu um erro e que deve acabar e passar ao proximo cliente
-    pthread_mutex_t lock;
+    char in_buf[sizeof(msg_play_t)];    // Jogada parcialmente lida do req pipe
+    size_t in_len;
+    msg_play_t plays[PLAY_QUEUE_SIZE];  // Jogadas ja lidas, por jogar (fila circular)
+    int plays_head;
+    int plays_len;
+    long pacman_next_tick;              // Proximo tick em que o pacman pode jogar
+    long ghost_next_tick[MAX_GHOSTS];   // Proximo tick em que cada fantasma joga
+    session_phase_t phase;
+    sched_task_t task;                  // Tarefa da sessao no scheduler
+    level_cache_t *levels;              // Niveis com que o jogo comecou (um reload nao os muda a meio)
+    int next_level;                     // Indice do proximo nivel em levels
+    board_t board;                      // Nivel atual
+    board_t next_board;                 // Copia do nivel seguinte, preparada enquanto se joga o atual
+    bool next_ready;                    // next_board tem o nivel next_level
+    int accumulated_points;
+    long tick;                          // Tick atual do nivel
+    long next_frame_tick;               // Proximo tick em que se envia um frame
+    int frame_interval;                 // Ticks entre frames, ajustado ao ritmo a que o cliente le
+    long ticks_run;                     // Ticks em que a sessao acordou de facto
+    long long level_start_ns;           // Instante em que o nivel comecou (CLOCK_MONOTONIC)
+    long long tick_ns_total;            // Tempo gasto nos ticks do nivel
+    long long tick_ns_max;
+    long long emit_ns_total;            // Parte do tempo dos ticks gasta a emitir frames (codificar e escrever)
+    long long emit_ns_max;
+    frame_out_t out;                    // Frames enviados ao cliente (base dos deltas)
+    shm_ring_t *ring;                   // TRANSPORT_SHM: anel em memoria partilhada do cliente
 } session_t;
 
-
+// Slot da fila de registos (fila MPMC limitada e pre-alocada, sem locks)
+// sequence indica em que volta da fila o slot pode ser escrito ou lido
 typedef struct {
-    board_t *board;
-    session_t *session;
-} pacman_thread_arg_t;
-
-typedef struct {
-    board_t *board;
-    int ghost_index;
-    pthread_t pacman_tid;   // Thread id da pacman_thread para a poder cancelar se os fantasmas matarem o pacman
-    session_t *session;
-} ghost_thread_arg_t;
+    _Atomic size_t sequence;
+    int req_rx;
+    int notif_tx;
+    int client_id;
+    int frame_mode;
+    shm_ring_t *ring;
+} registration_slot_t;
 
-typedef struct {
-    board_t *board;
-    session_t *session;
-} updates_thread_arg_t;
+// Estados do handshake de um cliente que ainda nao esta na fila
+typedef enum {
+    HANDSHAKE_REQ_OPEN,     // Falta abrir o request pipe (nunca bloqueia)
+    HANDSHAKE_NOTIF_OPEN,   // A espera que o client abra o notif pipe
+    HANDSHAKE_SOCKET_REG    // Ligacao por socket aceite, a espera do pacote de registo
+} handshake_state_t;
 
 typedef struct {
-    char directory_name[MAX_FILENAME];
-} session_thread_arg_t;
-
-typedef struct registration_node {
-    int req_rx;
-    int notif_tx;
+    msg_registration_t msg_reg;
     int client_id;
-    struct registration_node *next;
-} registration_node_t;
+    int req_rx;             // -1 enquanto o request pipe nao esta aberto (na ligacao por socket e o socket)
+    handshake_state_t state;
+    long long started_ns;   // Instante em que chegou o pedido de registo
+} handshake_t;
 
-registration_node_t *queue_head = NULL;
-registration_node_t *queue_tail = NULL;
-pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+// Handshakes pendentes (so usados pela thread de hosting)
+static handshake_t *handshakes = NULL;
+static int n_handshakes = 0;
+static int handshakes_capacity = 0;
+
+static registration_slot_t registration_queue[REGISTRATION_QUEUE_SIZE];
+static _Atomic size_t registration_enqueue_pos = 0;
+static _Atomic size_t registration_dequeue_pos = 0;
 
 session_t** sessions;
 int max_sessions = 0;
 static volatile sig_atomic_t sigusr1_received = 0;
 pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
 
-sem_t semaforo_clientes;
+char level_directory[MAX_FILENAME];
+
+void admit_clients();
+
+// Entrada do top de jogadores; os campos sao atomicos porque os leitores copiam-nos sem lock
+typedef struct {
+    _Atomic int id;
+    _Atomic int points;
+} top_entry_t;
+
+// Top LEADERBOARD_SIZE das sessoes ativas, atualizado sempre que os pontos de uma sessao mudam
+// Os writers (tarefas das sessoes) sao serializados por top_lock; os leitores nao bloqueiam:
+// top_seq e impar enquanto o top esta a ser alterado e o leitor repete a copia se ele mudou
+static top_entry_t top_players[LEADERBOARD_SIZE];
+static _Atomic int top_count = 0;
+static _Atomic unsigned top_seq = 0;
+static pthread_mutex_t top_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Ordem da leaderboard: pontuacao decrescente e, em caso de empate, id crescente
+static bool ranks_before(int id_a, int points_a, int id_b, int points_b) {
+    if (points_a != points_b) return points_a > points_b;
+    return id_a < id_b;
+}
+
+static void top_begin_write(void) {
+    unsigned seq = atomic_load_explicit(&top_seq, memory_order_relaxed);
+    atomic_store_explicit(&top_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void top_end_write(void) {
+    unsigned seq = atomic_load_explicit(&top_seq, memory_order_relaxed);
+    atomic_store_explicit(&top_seq, seq + 1, memory_order_release);
+}
+
+static void top_set(int i, int id, int points) {
+    atomic_store_explicit(&top_players[i].id, id, memory_order_relaxed);
+    atomic_store_explicit(&top_players[i].points, points, memory_order_relaxed);
+}
+
+// Poe (id, points) na posicao certa de um top com count entradas, descartando a ultima se estiver cheio
+// Chamado com top_lock e dentro de top_begin_write/top_end_write; O(LEADERBOARD_SIZE)
+static int top_insert(int count, int id, int points) {
+    int i = count < LEADERBOARD_SIZE ? count : LEADERBOARD_SIZE - 1;
+    if (count == LEADERBOARD_SIZE) {
+        int last_id = atomic_load_explicit(&top_players[i].id, memory_order_relaxed);
+        int last_points = atomic_load_explicit(&top_players[i].points, memory_order_relaxed);
+        if (!ranks_before(id, points, last_id, last_points)) return count;
+    } else {
+        count++;
+    }
+    // Desce as entradas que ficam atras da nova
+    while (i > 0) {
+        int prev_id = atomic_load_explicit(&top_players[i - 1].id, memory_order_relaxed);
+        int prev_points = atomic_load_explicit(&top_players[i - 1].points, memory_order_relaxed);
+        if (!ranks_before(id, points, prev_id, prev_points)) break;
+        top_set(i, prev_id, prev_points);
+        i--;
+    }
+    top_set(i, id, points);
+    return count;
+}
+
+// Tira a entrada i do top, puxando as seguintes para cima
+static int top_remove_at(int count, int i) {
+    for (; i < count - 1; i++) {
+        top_set(i, atomic_load_explicit(&top_players[i + 1].id, memory_order_relaxed),
+                atomic_load_explicit(&top_players[i + 1].points, memory_order_relaxed));
+    }
+    return count - 1;
+}
+
+static int top_find(int count, int id) {
+    for (int i = 0; i < count; i++) {
+        if (atomic_load_explicit(&top_players[i].id, memory_order_relaxed) == id) return i;
+    }
+    return -1;
+}
+
+// Refaz o top a partir dos pontos de todas as sessoes ativas
+// So e preciso quando sai do top alguem que pode ter de ser substituido por uma sessao que nao estava la
+static int top_rebuild(void) {
+    int count = 0;
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < max_sessions; i++) {
+        if (!sessions[i]->active) continue;
+        count = top_insert(count, sessions[i]->id, atomic_load_explicit(&sessions[i]->score, memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return count;
+}
+
+// Publica os pontos atuais da sessao e atualiza o top; so a tarefa da sessao chama isto
+static void publish_score(session_t *session, int points) {
+    atomic_store_explicit(&session->score, points, memory_order_relaxed);
+
+    pthread_mutex_lock(&top_lock);
+    top_begin_write();
+    int count = atomic_load_explicit(&top_count, memory_order_relaxed);
+    int i = top_find(count, session->id);
+    if (i == -1) {
+        count = top_insert(count, session->id, points);
+    } else {
+        int old_points = atomic_load_explicit(&top_players[i].points, memory_order_relaxed);
+        count = top_remove_at(count, i);
+        // Os pontos so baixam se algo os repuser; nesse caso outra sessao pode passar a estar a frente
+        if (points < old_points && count == LEADERBOARD_SIZE - 1) count = top_rebuild();
+        else count = top_insert(count, session->id, points);
+    }
+    atomic_store_explicit(&top_count, count, memory_order_relaxed);
+    top_end_write();
+    pthread_mutex_unlock(&top_lock);
+}
+
+// Tira do top o cliente de uma sessao que acabou (ja inativa); se estava la, o lugar vai para a melhor das restantes
+// Recebe o id e nao a sessao porque o slot pode ja ter sido dado a outro cliente
+static void withdraw_score(int id) {
+    pthread_mutex_lock(&top_lock);
+    int count = atomic_load_explicit(&top_count, memory_order_relaxed);
+    if (top_find(count, id) != -1) {
+        top_begin_write();
+        atomic_store_explicit(&top_count, top_rebuild(), memory_order_relaxed);
+        top_end_write();
+    }
+    pthread_mutex_unlock(&top_lock);
+}
+
+// Copia o top sem bloquear os writers; devolve o numero de entradas
+static int read_top(int ids[LEADERBOARD_SIZE], int points[LEADERBOARD_SIZE]) {
+    while (true) {
+        unsigned seq = atomic_load_explicit(&top_seq, memory_order_acquire);
+        if (seq & 1) continue;
+        int count = atomic_load_explicit(&top_count, memory_order_relaxed);
+        for (int i = 0; i < count; i++) {
+            ids[i] = atomic_load_explicit(&top_players[i].id, memory_order_relaxed);
+            points[i] = atomic_load_explicit(&top_players[i].points, memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&top_seq, memory_order_relaxed) == seq) return count;
+    }
+}
 
 static int write_msg(int fd, const void *buf, size_t n) {
     size_t off = 0;
@@ -99,139 +311,109 @@ static int write_msg(int fd, const void *buf, size_t n) {
     return 0;
 }
 
-static int read_msg(int fd, void *buf, size_t n) {
-    size_t off = 0;
-    // Loop que garante que tudo é efetivamente lido
-    while (off < n) {
-        ssize_t r = read(fd, (char*)buf + off, n - off);
-        if (r < 0) {
-            // Se foi interrompido por sinal, tenta novamente
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        if (r == 0) return -1;
-        off += (size_t)r;
+// Prepara os slots da fila de registos
+void init_registration_queue() {
+    for (size_t i = 0; i < REGISTRATION_QUEUE_SIZE; i++) {
+        atomic_store_explicit(&registration_queue[i].sequence, i, memory_order_relaxed);
     }
-    return 0;
 }
 
 // Mete um client na fila
-void enqueue_registration(int req_rx, int notif_tx, int client_id) {
-    registration_node_t *new_node = malloc(sizeof(registration_node_t));
-    if (new_node == NULL) {
-        perror("[ERR]: Memory Exceeded\n");
-        exit(EXIT_FAILURE);
-    }
+// Devolve -1 se a fila estiver cheia
+int enqueue_registration(int req_rx, int notif_tx, int client_id, int frame_mode, shm_ring_t *ring) {
+    size_t pos = atomic_load_explicit(&registration_enqueue_pos, memory_order_relaxed);
+    registration_slot_t *slot;
 
-    new_node->req_rx = req_rx;
-    new_node->notif_tx = notif_tx;
-    new_node->client_id = client_id;
-    new_node->next = NULL;
-
-    pthread_mutex_lock(&queue_lock);
-
-    // Se a fila estiver vazia
-    if (queue_tail == NULL) {
-        queue_head = new_node;
-        queue_tail = new_node;
-    // Se a fila não estiver vazia
-    } else {
-        // Adiciona ao fim da fila
-        queue_tail->next = new_node;
-        queue_tail = new_node;
+    while (true) {
+        slot = &registration_queue[pos & (REGISTRATION_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        // O slot esta livre nesta volta: tenta reserva-lo
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&registration_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        // O slot ainda tem um cliente da volta anterior: a fila esta cheia
+        } else if (diff < 0) {
+            return -1;
+        // Outro produtor reservou o slot primeiro
+        } else {
+            pos = atomic_load_explicit(&registration_enqueue_pos, memory_order_relaxed);
+        }
     }
 
-    pthread_mutex_unlock(&queue_lock);
+    slot->req_rx = req_rx;
+    slot->notif_tx = notif_tx;
+    slot->client_id = client_id;
+    slot->frame_mode = frame_mode;
+    slot->ring = ring;
+    // Publica o slot aos consumidores
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 0;
 }
 
-// Tira umm client da fila
-int dequeue_registration(int *req_rx, int *notif_tx, int *client_id) {
-    pthread_mutex_lock(&queue_lock);
+// Tira um client da fila
+// Devolve -1 se a fila estiver vazia
+int dequeue_registration(int *req_rx, int *notif_tx, int *client_id, int *frame_mode, shm_ring_t **ring) {
+    size_t pos = atomic_load_explicit(&registration_dequeue_pos, memory_order_relaxed);
+    registration_slot_t *slot;
 
-    // Se a fila estiver vazia
-    if (queue_head == NULL) {
-        pthread_mutex_unlock(&queue_lock);
-        return -1;
-    }
-
-    registration_node_t *node = queue_head;
-    *req_rx = node->req_rx;
-    *notif_tx = node->notif_tx;
-    *client_id = node->client_id;
-
-    queue_head = node->next;
-
-    // Se o cliente a retirar é o único da fila
-    if (queue_head == NULL) {
-        queue_tail = NULL;
+    while (true) {
+        slot = &registration_queue[pos & (REGISTRATION_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        // O slot tem um cliente publicado: tenta retira-lo
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&registration_dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        // Ainda nao foi publicado nenhum cliente neste slot: a fila esta vazia
+        } else if (diff < 0) {
+            return -1;
+        // Outro consumidor retirou o cliente primeiro
+        } else {
+            pos = atomic_load_explicit(&registration_dequeue_pos, memory_order_relaxed);
+        }
     }
 
-    pthread_mutex_unlock(&queue_lock);
-
-    free(node);
+    *req_rx = slot->req_rx;
+    *notif_tx = slot->notif_tx;
+    *client_id = slot->client_id;
+    *frame_mode = slot->frame_mode;
+    *ring = slot->ring;
+    // Liberta o slot para a proxima volta da fila
+    atomic_store_explicit(&slot->sequence, pos + REGISTRATION_QUEUE_SIZE, memory_order_release);
     return 0;
 }
 
-// Converte o board numa string para ser enviado para o client
-void board_to_char(board_t *board, char* char_board) {
-
-    for (int y = 0; y < board->height; y++) {
-        for (int x = 0; x < board->width; x++) {
-            int idx = y * board->width + x;
-
-            char c = board->board[idx].content;
-
-            // Verifica se há um fantasma carregado na posicao
-            int ghost_charged = 0;
-            for (int g = 0; g < board->n_ghosts; g++) {
-                ghost_t* ghost = &board->ghosts[g];
-                if (ghost->pos_x == x && ghost->pos_y == y) {
-                    if (ghost->charged)
-                        ghost_charged = 1;
-                    break;
-                }
-            }
-
-            switch (c) {
-                case 'W': // Wall
-                    char_board[idx] = '#';
-                    break;
-
-                case 'P': // Pacman
-                    char_board[idx] = 'C';
-                    break;
-
-                case 'M': // Monster/Ghost
-                    if (ghost_charged) {
-                        char_board[idx] = 'G'; // Charged Monster/Ghost
-                    } else {
-                        char_board[idx] = 'M';
-                    }
-                    break;
-
-                case ' ': // Empty space
-                    if (board->board[idx].has_portal) {
-                        char_board[idx] = '@';
-                    }
-                    else if (board->board[idx].has_dot) {
-                        char_board[idx] = '.';
-                    }
-                    else
-                        char_board[idx] = ' ';
-                    break;
-
-                default:
-                    break;
-            }
-        }
+// Continua a escrever a mensagem pendente no notif pipe (O_NONBLOCK)
+// Devolve 1 se ja foi toda escrita, 0 se o pipe continua cheio e -1 se a escrita falhou
+static int session_flush(session_t *session) {
+    int flushed = frame_flush(&session->out);
+    if (flushed < 0) {
+        fprintf(stderr, "[ERR]: write failed\n");
+        session->error = 1;
     }
+    return flushed;
 }
 
 // Envia a informacao do board ao client
+// Os frames seguem como deltas contra o ultimo frame enviado, com um frame completo periodicamente
+// Cabecalho e corpo vao numa so escrita, a partir de buffers da sessao (sem alocar por frame)
+// Um cliente lento nunca bloqueia a sessao: se ainda nao leu o frame anterior, este e descartado
+// e o proximo e codificado a partir do board atual (ganha sempre o estado mais recente)
 int update_client(session_t *session, board_t *game_board, int mode) {
-    int notif_pipe_fd = session->notif_tx;
-    int victory = 0, game_over = 0, op_code = 4;
-    char *board_data =NULL;
+    // Os frames de fim de nivel e de fim de jogo so sao enviados depois de o pipe esvaziar
+    int flushed = session_flush(session);
+    if (flushed < 0) return -1;
+    if (flushed == 0) {
+        session->out.dropped++;
+        return 0;
+    }
+
+    int victory = 0, game_over = 0, op_code = OP_CODE_BOARD;
 
     // Quando o client passa um nivel
     if (mode == VICTORY) {
@@ -249,646 +431,913 @@ int update_client(session_t *session, board_t *game_board, int mode) {
     msg.victory = victory;
     msg.game_over = game_over;
 
-    // Se o game_board nao é o nulo:
-    if (mode !=ENDGAME){
-        msg.width = game_board->width;
-        msg.height = game_board->height;
-        msg.tempo = game_board->tempo;
-        msg.points = game_board->pacmans[0].points;
-        board_data = malloc((game_board->width * game_board->height));
-        if (board_data == NULL){
-            perror("Memory Exceeded\n");
-            exit(EXIT_FAILURE);
-        }
-        board_to_char(game_board, board_data);
-    // Se o game_board é o dummy board nulo
-    } else{
+    // Se o game_board é o dummy board nulo, so segue o cabecalho
+    if (mode == ENDGAME) {
         msg.width = 0;
         msg.height = 0;
         msg.tempo = 0;
         msg.points = 0;
+        if (frame_write(&session->out, &msg, sizeof(msg_board_update_t)) < 0) {
+            fprintf(stderr, "[ERR]: write failed\n");
+            session->error = 1;
+            return -1;
+        }
+        return 0;
     }
 
-    // Envia tudo menos a string do board
-    pthread_mutex_lock(&session->lock);
-    int written = write_msg(notif_pipe_fd, &msg, sizeof(msg_board_update_t));
-    if (written < 0) {
-        pthread_mutex_unlock(&session->lock);
+    msg.tempo = game_board->tempo;
+    msg.points = game_board->pacmans[0].points;
+    frame_encode(&session->out, game_board, &msg);
+
+    // So a tarefa da sessao escreve no notif pipe, por isso nao e preciso lock
+    if (frame_send(&session->out) < 0) {
         fprintf(stderr, "[ERR]: write failed\n");
-        if (board_data) free(board_data);
+        session->error = 1;
         return -1;
     }
-    if (mode!=ENDGAME) {
-        // Envia a string do board
-        write_msg(notif_pipe_fd, board_data, msg.width * msg.height);
-    }
-    pthread_mutex_unlock(&session->lock);
-    if (board_data) free(board_data);
     return 0;
 }
 
-// Thread que vai enviando ao client o board
-void* updates_thread(void *arg) {
-    updates_thread_arg_t *updates_thread_arg = (updates_thread_arg_t *) arg;
-    board_t *board = updates_thread_arg->board;
-    session_t *session = updates_thread_arg->session;
+// Le uma jogada do cliente sem bloquear (o req pipe esta em O_NONBLOCK)
+// Devolve 1 se leu uma jogada completa, 0 se ainda nao ha jogada e -1 se o cliente se desconectou
+static int poll_play(session_t *session, msg_play_t *msg) {
+    while (session->in_len < sizeof(msg_play_t)) {
+        ssize_t r = read(session->req_rx, session->in_buf + session->in_len, sizeof(msg_play_t) - session->in_len);
+        if (r < 0) {
+            // Se foi interrompido por sinal, tenta novamente
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        // EOF: o cliente fechou o pipe
+        if (r == 0) return -1;
+        session->in_len += (size_t)r;
+    }
+    memcpy(msg, session->in_buf, sizeof(msg_play_t));
+    session->in_len = 0;
+    return 1;
+}
 
-    sleep_ms(board->tempo / 2);
-    while (true) {
-        sleep_ms(board->tempo);
-        pthread_mutex_lock(&session->lock);
-        int shutdown = session->thread_shutdown;
-        pthread_mutex_unlock(&session->lock);
-        if (shutdown) {
-            pthread_exit(NULL);
-        }
-        pthread_rwlock_wrlock(&board->state_lock);
-        update_client(session, board, DEFAULT);
-        pthread_rwlock_unlock(&board->state_lock);
+// Le tudo o que o cliente ja escreveu no req pipe, sem bloquear
+// Disconnect e resync sao tratados logo, mesmo que o pacman ainda esteja a espera do seu passo;
+// as jogadas ficam na fila ate o pacman poder agir (com a fila cheia, o resto fica no pipe)
+static void drain_input(session_t *session, board_t *board, long tick) {
+    while (session->plays_len < PLAY_QUEUE_SIZE) {
+        msg_play_t msg;
+        int ret = poll_play(session, &msg);
+        if (ret == 0) return;
+        // Se a mensagem for um pedido de disconnect
+        if (ret == -1 || msg.op_code == OP_CODE_DISCONNECT) {
+            board->state = QUIT_GAME;
+            session->error = 1;
+            return;
+        }
+        // O cliente perdeu a base dos deltas: o frame completo segue ja neste tick
+        if (msg.op_code == OP_CODE_RESYNC) {
+            session->out.resync = true;
+            session->next_frame_tick = tick;
+            continue;
+        }
+        session->plays[(session->plays_head + session->plays_len) % PLAY_QUEUE_SIZE] = msg;
+        session->plays_len++;
     }
 }
 
-void* pacman_thread(void *arg) {
-    pacman_thread_arg_t *pacman_arg = (pacman_thread_arg_t *) arg;
-    board_t *board = pacman_arg->board;
-    session_t *session = pacman_arg->session;
-    int req_rx = session->req_rx;
+// O move_pacman e o move_ghost so movem numa em cada 1 + waiting chamadas, e as chamadas
+// sao feitas de (1 + passo) em (1 + passo) ticks a partir de call_tick: devolve o tick em
+// que a entidade se move de facto e deixa o waiting a zero, para esse tick ser o agendado
+static long acting_tick(long call_tick, int passo, int *waiting) {
+    long tick = call_tick + (long)(1 + passo) * *waiting;
+    *waiting = 0;
+    return tick;
+}
 
+// Fase do pacman: joga no maximo uma jogada da fila
+static void pacman_phase(session_t *session, board_t *board, long tick) {
     pacman_t* pacman = &board->pacmans[0];
 
-    while (true) {
-        // Verifica se o pacman ainda está vivo
-        if(!pacman->alive) {
-            pthread_rwlock_rdlock(&board->state_lock);
-            board->state = QUIT_GAME;
-            pthread_rwlock_unlock(&board->state_lock);
-            pthread_exit(NULL);
-        }
-        // Se o state do board nao é CONTINUE_PLAY, acabar thread imediatamente
-        if (board->state != CONTINUE_PLAY) {
-            pthread_exit(NULL);
-        }
+    // Verifica se o pacman ainda está vivo
+    if (!pacman->alive) {
+        board->state = QUIT_GAME;
+        return;
+    }
+    // Sem jogada pendente: o pacman volta a tentar no proximo tick
+    if (tick < session->pacman_next_tick || session->plays_len == 0) return;
 
-        sleep_ms(board->tempo * (1 + pacman->passo));
+    msg_play_t msg_play = session->plays[session->plays_head];
+    session->plays_head = (session->plays_head + 1) % PLAY_QUEUE_SIZE;
+    session->plays_len--;
+    session->pacman_next_tick = tick + 1 + pacman->passo;
+    pacman->waiting = 0;
 
-        command_t* play;
-        command_t c;
-        msg_play_t msg_play;
+    // Ignora se o comando enviado for inexistente
+    if (msg_play.command == '\0') return;
 
-        // Lê a mensagem do client
-        int ret = read_msg(req_rx, &msg_play, sizeof(msg_play_t));
-        // Se a mensagem for um pedido de disconnect
-        if (ret == -1 || msg_play.op_code == OP_CODE_DISCONNECT) {
-            pthread_rwlock_rdlock(&board->state_lock);
+    command_t c;
+    c.command = msg_play.command;
+    c.turns = 1;
+    c.turns_left = 1;
+
+    debug("KEY %c\n", c.command);
+
+    // Se o comando for de quit
+    if (c.command == 'Q') {
+        board->state = QUIT_GAME;
+        return;
+    }
+
+    // Joga o comando (o waiting esta a zero, por isso o move_pacman move ja)
+    int result = move_pacman(board, 0, &c);
+    session->pacman_next_tick = acting_tick(tick + 1 + pacman->passo, pacman->passo, &pacman->waiting);
+    if (result == REACHED_PORTAL) {
+        // Avança para o proximo nivel
+        board->state = NEXT_LEVEL;
+    } else if (result == DEAD_PACMAN) {
+        board->state = QUIT_GAME;
+    }
+}
+
+// Fase dos fantasmas: cada fantasma joga de (1 + passo) em (1 + passo) ticks
+static void ghosts_phase(session_t *session, board_t *board, long tick) {
+    for (int i = 0; i < board->n_ghosts; i++) {
+        ghost_t* ghost = &board->ghosts[i];
+        if (tick < session->ghost_next_tick[i] || ghost->n_moves == 0) continue;
+
+        // O tick agendado ja e o do movimento: o move_ghost nao volta a esperar
+        ghost->waiting = 0;
+        int result = move_ghost(board, i, &ghost->moves[ghost->current_move%ghost->n_moves]);
+        session->ghost_next_tick[i] = acting_tick(tick + 1 + ghost->passo, ghost->passo, &ghost->waiting);
+        if (result == DEAD_PACMAN) {
             board->state = QUIT_GAME;
-            pthread_rwlock_unlock(&board->state_lock);
-            pthread_mutex_lock(&session->lock);
-            session->error = 1;
-            session->thread_shutdown = 1;
-            pthread_mutex_unlock(&session->lock);
-            pthread_exit(NULL);
+            return;
         }
+    }
+}
+
+// Copia o nivel seguinte para next_board, para que a passagem de nivel seja so uma troca
+static void prefetch_level(session_t *session) {
+    if (session->next_ready || session->next_level >= session->levels->n_levels) return;
+    copy_level(&session->next_board, &session->levels->levels[session->next_level], 0);
+    session->next_ready = true;
+}
 
-        // Se a mensagem for uma jogada
-        c.command = msg_play.command;
+// Liberta o nivel seguinte ja copiado, quando o jogo acaba antes de la chegar
+static void drop_prefetch(session_t *session) {
+    if (!session->next_ready) return;
+    unload_level(&session->next_board);
+    session->next_ready = false;
+}
 
-        // Ignora se o comando enviado for inexistente
-        if(c.command == '\0') {
-            continue;
-        }
+// Fecha a sessao e liberta o slot para o proximo cliente da fila
+static long long session_close(session_t *session) {
+    scheduler_unwatch(session->req_rx);
+    close(session->req_rx);
+    // Na ligacao por socket os dois sentidos sao o mesmo fd
+    if (session->notif_tx != session->req_rx) close(session->notif_tx);
+    frame_ring_destroy(session->ring);
+    session->ring = NULL;
+    drop_prefetch(session);
+    level_cache_release(session->levels);
+    session->levels = NULL;
+
+    // A partir daqui a sessao pode ser reaproveitada por outro cliente
+    int id = session->id;
+    pthread_mutex_lock(&sessions_lock);
+    session->active = false;
+    pthread_mutex_unlock(&sessions_lock);
+    withdraw_score(id);
 
-        c.turns = 1;
-        play = &c;
+    admit_clients();
+    return -1;
+}
 
-        debug("KEY %c\n", play->command);
+// Na ligacao por socket cada mensagem e um pacote, que tem de caber no buffer de envio que o kernel deu
+// de facto; verifica que o maior frame dos niveis do jogo cabe, para nao falhar a meio com EMSGSIZE
+static bool socket_fits_levels(session_t *session) {
+    int sndbuf;
+    socklen_t len = sizeof(sndbuf);
+    if (getsockopt(session->notif_tx, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1) {
+        perror("[ERR]: getsockopt(SO_SNDBUF) failed");
+        return false;
+    }
 
-        pthread_rwlock_rdlock(&board->state_lock);
+    size_t largest = 0;
+    for (int i = 0; i < session->levels->n_levels; i++) {
+        board_t *level = &session->levels->levels[i];
+        size_t size = frame_max_size(session->out.mode, level->width, level->height,
+                                     level->n_pacmans + level->n_ghosts);
+        if (size > largest) largest = size;
+    }
+    if (largest + SOCKET_PACKET_OVERHEAD > (size_t)sndbuf) {
+        fprintf(stderr, "[ERR]: client %d: frames of up to %zu bytes do not fit the socket send buffer (%d bytes), "
+                "raise net.core.wmem_max or connect through the FIFOs\n", session->id, largest, sndbuf);
+        return false;
+    }
+    return true;
+}
 
-        // Se o comando for de quit
-        if (play->command == 'Q') {
-            board->state = QUIT_GAME;
-            pthread_rwlock_unlock(&board->state_lock);
-            pthread_exit(NULL);
+// Responde ao pedido de ligacao e prepara a leitura dos niveis
+static long long session_connect(session_t *session) {
+    // O jogo fica com a versao atual dos niveis ate ao fim
+    session->levels = level_playlist_acquire();
+    session->next_level = 0;
+
+    msg_reg_response_t response;
+    response.op_code = OP_CODE_CONNECT;
+    response.result = 0;
+    response.transport = session->ring != NULL ? TRANSPORT_SHM : TRANSPORT_FIFO;
+    if (session->out.is_socket) {
+        response.transport = TRANSPORT_SOCKET;
+        // Recusa a ligacao logo no handshake em vez de a perder no primeiro frame grande
+        if (!socket_fits_levels(session)) {
+            response.result = 1;
+            frame_write(&session->out, &response, sizeof(msg_reg_response_t));
+            return session_close(session);
         }
+    }
 
-        // Joga o comando
-        int result = move_pacman(board, 0, play);
-        if (result == REACHED_PORTAL) {
-            // Avança para o proximo nivel
-            board->state = NEXT_LEVEL;
-            pthread_rwlock_unlock(&board->state_lock);
-            break;
+    // Tenta enviar uma resposta ao cliente de se se conseguiu conectar ou nao
+    // A resposta segue sempre pelo notif pipe, que ainda esta vazio, por isso e escrita toda de uma vez
+    if (frame_write(&session->out, &response, sizeof(msg_reg_response_t)) < 0) {
+        perror("[ERR]: write failed");
+        return session_close(session);
+    }
+    // Daqui em diante as mensagens seguem pelo anel, se o cliente o pediu
+    session->out.ring = session->ring;
+
+    // O req pipe (ou o socket) ja vem em O_NONBLOCK do handshake: as jogadas sao lidas sem bloquear,
+    // nos ticks agendados ou logo que chegam (o scheduler acorda a sessao)
+    if (scheduler_watch(&session->task, session->req_rx) == -1) return session_close(session);
+
+    // O cliente entra na leaderboard com 0 pontos
+    publish_score(session, 0);
+
+    session->phase = SESSION_LEVEL_START;
+    return monotonic_ns();
+}
+
+// Carrega o proximo nivel da diretoria e envia o primeiro frame
+static long long session_level_start(session_t *session) {
+    board_t *board = &session->board;
+
+    // O resultado do nivel anterior tem de chegar ao cliente antes do primeiro frame do seguinte
+    int flushed = session_flush(session);
+    if (flushed < 0) return session_close(session);
+    if (flushed == 0) return monotonic_ns() + FLUSH_RETRY_MS * 1000000LL;
+
+    // O nivel ja foi lido no arranque: o jogo fica com uma copia do estado inicial,
+    // normalmente ja preparada durante o nivel anterior
+    if (session->next_level < session->levels->n_levels) {
+        if (session->next_ready) {
+            *board = session->next_board;
+            session->next_ready = false;
+            board->pacmans[0].points = session->accumulated_points;
+        } else {
+            copy_level(board, &session->levels->levels[session->next_level], session->accumulated_points);
         }
+        session->next_level++;
 
-        if(result == DEAD_PACMAN) {
-            board->state = QUIT_GAME;
-            pthread_rwlock_unlock(&board->state_lock);
-            break;
+        board->state = CONTINUE_PLAY;
+        frame_out_reset(&session->out);
+        update_client(session, board, DEFAULT);
+
+        session->tick = 0;
+        session->next_frame_tick = 0;
+        session->frame_interval = 1;
+        session->ticks_run = 0;
+        session->tick_ns_total = 0;
+        session->tick_ns_max = 0;
+        session->emit_ns_total = 0;
+        session->emit_ns_max = 0;
+        pacman_t *pacman = &board->pacmans[0];
+        session->pacman_next_tick = acting_tick(pacman->passo, pacman->passo, &pacman->waiting);
+        for (int i = 0; i < board->n_ghosts; i++) {
+            ghost_t *ghost = &board->ghosts[i];
+            session->ghost_next_tick[i] = acting_tick(ghost->passo, ghost->passo, &ghost->waiting);
         }
 
-        pthread_rwlock_unlock(&board->state_lock);
+        session->phase = SESSION_PLAYING;
+        session->level_start_ns = monotonic_ns();
+        return session->level_start_ns + (long long)board->tempo * 1000000LL;
     }
 
-    pthread_exit(NULL);
+    // Se já não há mais níveis
+    session->phase = SESSION_GAME_END;
+    return monotonic_ns();
 }
 
-void* ghost_thread(void *arg) {
-    ghost_thread_arg_t *ghost_arg = (ghost_thread_arg_t*) arg;
-    board_t *board = ghost_arg->board;
-    int ghost_ind = ghost_arg->ghost_index;
-    pthread_t pacman_tid = ghost_arg->pacman_tid;
-    session_t *session = ghost_arg->session;
+// Trata do fim de um nivel (vitoria, game over ou erro)
+static long long session_level_end(session_t *session) {
+    board_t *board = &session->board;
+    int result = board->state;
 
-    ghost_t* ghost = &board->ghosts[ghost_ind];
+    // O jogo acaba neste nivel (erro, quit ou morte): o nivel seguinte ja copiado nao vai ser jogado
+    if (session->error == 1 || result != NEXT_LEVEL) drop_prefetch(session);
 
-    while (true) {
-        sleep_ms(board->tempo * (1 + ghost->passo));
+    // O ultimo frame do nivel pode ainda estar no pipe: espera que o cliente o leia, sem bloquear a thread
+    if (session->error == 0) {
+        int flushed = session_flush(session);
+        if (flushed == 0) return monotonic_ns() + FLUSH_RETRY_MS * 1000000LL;
+    }
+    long long pause = monotonic_ns() + (long long)board->tempo * 1000000LL;
+
+    debug("Level %s: %ld ticks (%ld woken), avg %lld us, max %lld us, %d dots left\n", board->level_name,
+          session->tick + 1, session->ticks_run,
+          session->ticks_run > 0 ? session->tick_ns_total / session->ticks_run / 1000 : 0,
+          session->tick_ns_max / 1000, board_dots_left(board));
+    debug("Level %s: %ld frames (%ld full, %ld dropped), %lld bytes sent, last every %d ticks\n",
+          board->level_name, session->out.frames, session->out.keyframes, session->out.dropped,
+          session->out.bytes, session->frame_interval);
+    // Tempo em que a simulacao esteve parada a emitir frames
+    debug("Level %s: frame emission %lld us (%lld%% of tick time), max %lld us\n", board->level_name,
+          session->emit_ns_total / 1000,
+          session->tick_ns_total > 0 ? session->emit_ns_total * 100 / session->tick_ns_total : 0,
+          session->emit_ns_max / 1000);
+
+    // Se ocorreu algum erro, passar para o proximo client da fila
+    if (session->error == 1) {
+        unload_level(board);
+        return session_close(session);
+    }
 
-        // Se o jogo tiver acabado, para (preventivo)
-        pthread_mutex_lock(&session->lock);
-        int shutdown = session->thread_shutdown;
-        pthread_mutex_unlock(&session->lock);
-        if (shutdown) pthread_exit(NULL);
+    // Os pontos passam para o proximo nivel
+    session->accumulated_points = board->pacmans[0].points;
 
-        pthread_rwlock_rdlock(&board->state_lock);
-        if (board->state != CONTINUE_PLAY) {
-            pthread_rwlock_unlock(&board->state_lock);
-            pthread_exit(NULL);
-        }
+    // Se for para avançar para um novo nivel
+    if (result == NEXT_LEVEL) {
+        update_client(session, board, VICTORY);
+        session->phase = SESSION_LEVEL_START;
+    // Se o pacman sair do jogo ou morrer
+    } else {
+        update_client(session, board, GAMEOVER);
+        session->phase = SESSION_GAME_END;
+    }
+    unload_level(board);
+    return pause;
+}
 
-        if (move_ghost(board, ghost_ind, &ghost->moves[ghost->current_move%ghost->n_moves])==DEAD_PACMAN) {
-            board->state = QUIT_GAME;
-            pthread_cancel(pacman_tid);
-            pthread_rwlock_unlock(&board->state_lock);
-            pthread_exit(NULL);
-        }
-        pthread_rwlock_unlock(&board->state_lock);
+// Ajusta o intervalo entre frames ao ritmo a que o cliente le o notif pipe
+// Se o frame anterior ainda nao tinha sido lido (bytes no pipe ou frame descartado), o intervalo duplica;
+// se o cliente ja tinha lido tudo, o intervalo volta a descer um tick de cada vez
+// Vitoria e morte nao dependem disto: o frame de fim de nivel e sempre entregue
+static void adapt_frame_interval(session_t *session, int unread, long dropped) {
+    if (unread > 0 || session->out.dropped > dropped) {
+        session->frame_interval *= 2;
+        if (session->frame_interval > FRAME_INTERVAL_MAX) session->frame_interval = FRAME_INTERVAL_MAX;
+    } else if (unread == 0 && session->frame_interval > 1) {
+        session->frame_interval--;
     }
 }
 
-void* session_thread(void *arg) {
+// Proximo tick, a partir de from, em que o pacman, algum fantasma ou o envio de um frame tem de acontecer
+static long next_active_tick(session_t *session, board_t *board, long from) {
+    long next = session->next_frame_tick;
 
-    // SIGUSR1 ignora-se nas sessions
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGUSR1);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    // Sem jogadas na fila o pacman nao conta: a chegada de uma acorda a sessao
+    if (session->plays_len > 0 && session->pacman_next_tick < next) next = session->pacman_next_tick;
+    for (int i = 0; i < board->n_ghosts; i++) {
+        if (board->ghosts[i].n_moves == 0) continue;
+        if (session->ghost_next_tick[i] < next) next = session->ghost_next_tick[i];
+    }
+    return next < from ? from : next;
+}
 
-    session_thread_arg_t *session_arg = (session_thread_arg_t*) arg;
-    char directory_name[MAX_FILENAME];
-    strcpy(directory_name, session_arg->directory_name);
-    free(session_arg);
+// Instante em que o tick acaba e o seguinte tem de correr
+// Os ticks sao marcados em tempo absoluto para nao acumularem atraso
+static long long tick_deadline(session_t *session, board_t *board, long tick) {
+    return session->level_start_ns + (tick + 1) * (long long)board->tempo * 1000000LL;
+}
 
-    // Gera uma seed para os movimentos aleatorios
-    srand((unsigned int)time(NULL));
+// Um tick do nivel: avanca o pacman, os fantasmas e envia o frame ao client, por esta ordem
+static long long session_tick(session_t *session) {
+    board_t *board = &session->board;
+    long long tick_start = monotonic_ns();
 
-    while (true) {
-        bool next_client = false;
-        sem_wait(&semaforo_clientes);
-        int req_rx, notif_tx, client_id;
-
-        // Tenta obter um cliente que esta a esperar para entrar nua session ate conseguir
-        int result = dequeue_registration(&req_rx, &notif_tx, &client_id);
-        if (result == -1) {
-            sem_post(&semaforo_clientes);
-            sleep_ms(100);
-            continue;
-        }
+    drain_input(session, board, session->tick);
+    if (board->state == CONTINUE_PLAY) {
+        pacman_phase(session, board, session->tick);
+    }
+    if (board->state == CONTINUE_PLAY) {
+        ghosts_phase(session, board, session->tick);
+    }
+    // Os pontos so mudam quando o pacman come; so entao se mexe na leaderboard
+    if (board->pacmans[0].points != atomic_load_explicit(&session->score, memory_order_relaxed)) {
+        publish_score(session, board->pacmans[0].points);
+    }
+    if (board->state == CONTINUE_PLAY && session->tick >= session->next_frame_tick) {
+        // O frame e codificado para o buffer de tras (snapshot do board) e so depois escrito;
+        // a escrita nunca bloqueia, por isso o tick so espera pela codificacao e pela syscall
+        long long emit_start = monotonic_ns();
+        // O que ficou por ler do frame anterior mede o ritmo do cliente
+        int unread = frame_unread(&session->out);
+        long dropped = session->out.dropped;
+        // Se o cliente deixou de ler (pipe fechado), o nivel acaba
+        if (update_client(session, board, DEFAULT) < 0) board->state = QUIT_GAME;
+        long long emit_ns = monotonic_ns() - emit_start;
+        session->emit_ns_total += emit_ns;
+        if (emit_ns > session->emit_ns_max) session->emit_ns_max = emit_ns;
+        adapt_frame_interval(session, unread, dropped);
+        session->next_frame_tick = session->tick + session->frame_interval;
+    }
 
-        msg_reg_response_t response;
-        response.op_code = OP_CODE_CONNECT;
-        response.result = result;
+    long long tick_ns = monotonic_ns() - tick_start;
+    session->tick_ns_total += tick_ns;
+    if (tick_ns > session->tick_ns_max) session->tick_ns_max = tick_ns;
+    session->ticks_run++;
 
-        // Tenta enviar uma resposta ao cliente de se se conseguiu conectar ou nao
-        int response_write = write_msg(notif_tx, &response, sizeof(msg_reg_response_t));
-        if (response_write < 0) {
-            perror("[ERR]: write failed");
-            result = 1;
-        }
-        if (result == 1) {
-            close(req_rx);
-            close(notif_tx);
+    // Passados os primeiros ticks, prepara o nivel seguinte para a transicao ser so uma troca
+    if (board->state == CONTINUE_PLAY && session->tick >= PREFETCH_DELAY_TICKS) prefetch_level(session);
+
+    if (board->state != CONTINUE_PLAY) {
+        session->phase = SESSION_LEVEL_END;
+        return session_level_end(session);
+    }
+
+    // Salta diretamente para o proximo tick em que alguma coisa acontece
+    session->tick = next_active_tick(session, board, session->tick + 1);
+    return tick_deadline(session, board, session->tick);
+}
+
+// O req pipe acordou a sessao antes do tick agendado: le o que chegou e antecipa
+// o tick se o pacman ja pode jogar ou se o cliente pediu um frame completo
+static long long session_input(session_t *session) {
+    board_t *board = &session->board;
+
+    // Primeiro tick que ainda nao acabou (nunca passa do agendado, que ainda nao venceu)
+    long long tempo_ns = (long long)board->tempo * 1000000LL;
+    long from = session->tick;
+    if (tempo_ns > 0) from = (long)((monotonic_ns() - session->level_start_ns) / tempo_ns);
+    if (from > session->tick) from = session->tick;
+
+    drain_input(session, board, from);
+    if (board->state != CONTINUE_PLAY) {
+        session->phase = SESSION_LEVEL_END;
+        return session_level_end(session);
+    }
+    session->tick = next_active_tick(session, board, from);
+    return tick_deadline(session, board, session->tick);
+}
+
+// Envia o board final e passa a esperar pelo pedido de disconnect
+static long long session_game_end(session_t *session) {
+    int flushed = session_flush(session);
+    if (flushed < 0) return session_close(session);
+    if (flushed == 0) return monotonic_ns() + FLUSH_RETRY_MS * 1000000LL;
+
+    board_t end_board;
+    memset(&end_board, 0, sizeof(board_t));
+    update_client(session, &end_board, ENDGAME);
+
+    session->phase = SESSION_WAIT_DISCONNECT;
+    return monotonic_ns();
+}
+
+// Lê mensagens do client ate receber mensagem de disconnect
+static long long session_wait_disconnect(session_t *session) {
+    // Acaba de enviar o board final antes de fechar o pipe
+    int flushed = session_flush(session);
+    if (flushed < 0) return session_close(session);
+    if (flushed == 0) return monotonic_ns() + FLUSH_RETRY_MS * 1000000LL;
+
+    while (true) {
+        char msg;
+        ssize_t bytes_read = read(session->req_rx, &msg, 1);
+        if (bytes_read == 1) {
+            if (msg == ('0'+OP_CODE_DISCONNECT)) break;
             continue;
         }
-
-        // Aloca memoria para a session e inicializa-a
-        session_t *session = malloc(sizeof(session_t));
-        if (session == NULL){
-            perror("Memory Exceeded\n");
-            exit(EXIT_FAILURE);
+        if (bytes_read == 0) {
+            break;
         }
-        pthread_mutex_init(&session->lock, NULL);
-        session->req_rx = req_rx;
-        session->notif_tx = notif_tx;
-        session->thread_shutdown = 0;
-        session->error = 0;
-        session->id = client_id;
-        session->points = malloc(sizeof(int));
-        if (session->points == NULL){
-            perror("Memory Exceeded\n");
-            exit(EXIT_FAILURE);
+        // Se read for interrompido por sinal, continua
+        if (errno == EINTR) continue;
+        // Ainda nao ha mensagens: volta a verificar mais tarde
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return monotonic_ns() + DISCONNECT_POLL_MS * 1000000LL;
         }
-        *session->points = 0;
-        session->active = true;
+        perror("[ERR]: Unable to read disconnect message\n");
+        break;
+    }
+    return session_close(session);
+}
+
+// Corre um passo da sessao; cada sessao e uma tarefa do scheduler
+static long long session_step(sched_task_t *task) {
+    session_t *session = (session_t*) task->arg;
+
+    // Acordada pelo req pipe antes da hora: em jogo le as jogadas, no fim do jogo
+    // le o disconnect; nas restantes fases o pipe so e lido na hora marcada
+    if (monotonic_ns() < task->deadline) {
+        if (session->phase == SESSION_PLAYING) return session_input(session);
+        if (session->phase != SESSION_WAIT_DISCONNECT) return task->deadline;
+    }
+
+    switch (session->phase) {
+        case SESSION_CONNECT:
+            return session_connect(session);
+        case SESSION_LEVEL_START:
+            return session_level_start(session);
+        case SESSION_PLAYING:
+            return session_tick(session);
+        case SESSION_LEVEL_END:
+            return session_level_end(session);
+        case SESSION_GAME_END:
+            return session_game_end(session);
+        case SESSION_WAIT_DISCONNECT:
+            return session_wait_disconnect(session);
+    }
+    return -1;
+}
 
-        // Encontra slot livre no array sessions e ocupa-o (as sessions sao bloqueadas de forma preventiva)
+// Enquanto houver slots livres e clientes na fila, cria sessoes e entrega-as ao scheduler
+void admit_clients() {
+    while (true) {
+        // Encontra slot livre no array sessions (as sessions sao bloqueadas de forma preventiva)
         pthread_mutex_lock(&sessions_lock);
         int slot = -1;
         for (int i = 0; i < max_sessions; i++) {
-            if (sessions[i] == NULL || !sessions[i]->active) {
-                if (sessions[i] != NULL) {
-                    free(sessions[i]); // Se houver uma session inativa, apaga-a
-                }
-                sessions[i] = session;
+            if (!sessions[i]->active) {
                 slot = i;
                 break;
             }
         }
-        pthread_mutex_unlock(&sessions_lock);
-        if (slot == -1) {
-            fprintf(stderr, "[ERR]: No slot available in sessions array\n");
-            pthread_mutex_destroy(&session->lock);
-            sem_post(&semaforo_clientes);
-            close(req_rx);
-            close(notif_tx);
-            exit(EXIT_FAILURE);
+        int req_rx, notif_tx, client_id, frame_mode;
+        shm_ring_t *ring;
+        if (slot == -1 || dequeue_registration(&req_rx, &notif_tx, &client_id, &frame_mode, &ring) == -1) {
+            pthread_mutex_unlock(&sessions_lock);
+            return;
         }
 
+        // As sessions sao pre-alocadas no arranque e reaproveitadas de cliente para cliente
+        session_t *session = sessions[slot];
+        // Os buffers de frames ficam com o slot; so a base do cliente anterior e esquecida
+        frame_out_t out = session->out;
+        memset(session, 0, sizeof(session_t));
+        session->out = out;
+        session->out.mode = frame_mode;
+        frame_out_attach(&session->out, notif_tx);
+        session->req_rx = req_rx;
+        session->notif_tx = notif_tx;
+        session->ring = ring;
+        session->id = client_id;
+        session->active = true;
+        session->phase = SESSION_CONNECT;
+        session->task.run = session_step;
+        session->task.arg = session;
+        pthread_mutex_unlock(&sessions_lock);
 
-        DIR* level_dir = opendir(directory_name);
+        scheduler_submit(&session->task, monotonic_ns());
+    }
+}
 
-        if (level_dir == NULL) {
-            fprintf(stderr, "Failed to open directory\n");
-            pthread_mutex_destroy(&session->lock);
-            pthread_mutex_lock(&sessions_lock);
-            session->active = false;
-            pthread_mutex_unlock(&sessions_lock);
-            sem_post(&semaforo_clientes);
-            continue;
-        }
+void leaderboard_generator() {
+    // Copia o top mantido pelas sessoes: O(LEADERBOARD_SIZE), sem percorrer nem bloquear as sessoes
+    int ids[LEADERBOARD_SIZE], points[LEADERBOARD_SIZE];
+    int top_n = read_top(ids, points);
 
-        board_t game_board;
-        int accumulated_points = 0;
-        bool end_game = false;
-
-        struct dirent* entry;
-        while ((entry = readdir(level_dir)) != NULL && !end_game) {
-            if (entry->d_name[0] == '.') continue;
-
-            char *dot = strrchr(entry->d_name, '.');
-            if (!dot) continue;
-
-            // Por cada nivel
-            if (strcmp(dot, ".lvl") == 0) {
-                load_level(&game_board, entry->d_name, directory_name, accumulated_points);
-                session->points = &(game_board.pacmans[0].points);
-
-                game_board.state = CONTINUE_PLAY;
-                update_client(session, &game_board, DEFAULT);
-
-                while(true) {
-                    // Cria e alloca memorias para ghost ids, pacman id e update id
-                    pthread_t update_tid, pacman_tid;
-                    pthread_t *ghost_tids = malloc(game_board.n_ghosts * sizeof(pthread_t));
-                    if (ghost_tids == NULL){
-                        perror("[ERR]: Memory Exceeded\n");
-                        exit(EXIT_FAILURE);
-                    }
-
-                    session->thread_shutdown = 0;
-
-                    debug("Creating threads\n");
-
-                    // Inicializaçao dos argumentos da pacman thread
-                    pacman_thread_arg_t *pac_arg = malloc(sizeof(pacman_thread_arg_t));
-                    if (pac_arg == NULL){
-                        perror("[ERR]: Memory Exceeded\n");
-                        exit(EXIT_FAILURE);
-                    }
-                    pac_arg->board = &game_board;
-                    pac_arg->session = session;
-                    // Cria a pacman thread
-                    int pac_thread_create_check = pthread_create(&pacman_tid, NULL, pacman_thread, (void*) pac_arg);
-                    if (pac_thread_create_check == -1){
-                        perror("[ERR]: Failed to create pacman thread\n");
-                        pthread_mutex_lock(&session->lock);
-                        session->thread_shutdown = 1;
-                        session->error = 1;
-                        pthread_mutex_unlock(&session->lock);
-                    }
-
-                    // Inicializacao dos argumentos das ghost threads
-                    for (int i = 0; i < game_board.n_ghosts; i++) {
-                        ghost_thread_arg_t *ghost_arg = malloc(sizeof(ghost_thread_arg_t));
-                        if (ghost_arg == NULL){
-                            perror("[ERR]: Memory Exceeded\n");
-                            exit(EXIT_FAILURE);
-                        }
-                        ghost_arg->board = &game_board;
-                        ghost_arg->ghost_index = i;
-                        ghost_arg->pacman_tid = pacman_tid;
-                        ghost_arg->session = session;
-                        // Cria as ghost threads
-                        int ghost_thread_create_check = pthread_create(&ghost_tids[i], NULL, ghost_thread, (void*) ghost_arg);
-                        if (ghost_thread_create_check == -1){
-                            perror("Failed to create ghost thread\n");
-                            session->thread_shutdown = 1;
-                            pthread_mutex_lock(&session->lock);
-                            session->error = 1;
-                            pthread_mutex_unlock(&session->lock);
-                            break;
-                        }
-                    }
-                    // Inicializaçao dos argumentos da update thraed
-                    updates_thread_arg_t *updates_arg = malloc(sizeof(updates_thread_arg_t));
-                    if (updates_arg == NULL){
-                        perror("Memory Exceeded\n");
-                        exit(EXIT_FAILURE);
-                    }
-                    updates_arg->board = &game_board;
-                    updates_arg->session = session;
-                    // Cria a updates thread
-                    int update_thread_create_check = pthread_create(&update_tid, NULL, updates_thread, (void*) updates_arg);
-                    if (update_thread_create_check == -1){
-                        perror("Failed to create updates thread\n");
-                        pthread_mutex_lock(&session->lock);
-                        session->thread_shutdown = 1;
-                        session->error = 1;
-                        pthread_mutex_unlock(&session->lock);
-                    }
-
-                    // Espera que a thread do pacman termine
-                    pthread_join(pacman_tid, NULL);
-
-                    pthread_mutex_lock(&session->lock);
-                    int* err = &session->error;
-                    pthread_mutex_unlock(&session->lock);
-                    // Se ocorreu algum erro, passar para o proximo client da fila quando for possivel
-                    if (*err==1) {
-                        free(ghost_tids);
-                        next_client = true;
-                        break;
-                    }
-
-                    // Dar o sinal para terminar as threads
-                    pthread_mutex_lock(&session->lock);
-                    session->thread_shutdown = 1;
-                    pthread_mutex_unlock(&session->lock);
-
-                    // Espera que as threads acabem todas
-                    pthread_join(update_tid, NULL);
-                    for (int i = 0; i < game_board.n_ghosts; i++) {
-                        pthread_join(ghost_tids[i], NULL);
-                    }
-
-                    free(ghost_tids);
-
-                    int result = game_board.state;
-
-                    // Se for para avançar para um novo nivel
-                    if(result == NEXT_LEVEL) {
-                        accumulated_points = game_board.pacmans[0].points;
-                        update_client(session, &game_board, VICTORY);
-                        sleep_ms(game_board.tempo);
-                        break;
-                    }
-
-                    // Se o pacman sair do jogo ou morrer
-                    if(result == QUIT_GAME) {
-                        update_client(session, &game_board, GAMEOVER);
-                        sleep_ms(game_board.tempo);
-                        end_game = true;
-                        break;
-                    }
-
-                    // Recebe os movimentos dos ghosts, etc...
-                    update_client(session, &game_board, DEFAULT);
-                }
-                // No final de um nivel
-                unload_level(&game_board);
-                // Se ocorreu um erro, avança-se para dar a thread a outro cliente
-                if (next_client==true) {
-                    break;
-                }
-            }
-        }
-        // Se ocorrer algum erro procede para o proximo cliente
-        if (next_client) {
-            pthread_mutex_lock(&sessions_lock);
-            session->active = false;
-            pthread_mutex_unlock(&sessions_lock);
-            closedir(level_dir);
-            close(req_rx);
-            close(notif_tx);
-            pthread_mutex_destroy(&session->lock);
-            sem_post(&semaforo_clientes);
-            continue;
-        }
+    // Monta o ficheiro inteiro num buffer para o escrever de uma so vez
+    char buf[LEADERBOARD_SIZE * LINE_MAX];
+    size_t len = 0;
+    for (int i = 0; i < top_n; i++) {
+        len += (size_t)snprintf(buf + len, sizeof(buf) - len, "ID: %d, Pontos: %d\n", ids[i], points[i]);
+    }
 
-        // Se já não há mais níveis
-        board_t end_board;
-        memset(&end_board, 0, sizeof(board_t));
-        update_client(session, &end_board, ENDGAME);
-        // Lê mensagens do client ate receber mensagem de disconnect
-        while (true) {
-            char msg;
-            ssize_t bytes_read = read(req_rx, &msg, 1);
-            if (bytes_read == -1){
-                perror("[ERR]: Unable to read disconnect message\n");
-                break;
-            }
-            if (bytes_read == 1) {
-                if (msg == ('0'+OP_CODE_DISCONNECT)) break;
-                continue;
-            }
-            if (bytes_read == 0) {
-                break;
-            }
-            // Se read for interrompido por sinal, continua
-            if (errno == EINTR) continue;
-            perror("[ERR]: Invalid disconnect message\n");
-            break;
-        }
+    // Escreve para um ficheiro temporario e troca-o pelo topPlayers.txt,
+    // para que quem o le veja sempre uma leaderboard completa
+    int fd = open("topPlayers.txt.tmp", O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+        return;
+    }
+    if (write_msg(fd, buf, len) == -1) {
+        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
+        close(fd);
+        unlink("topPlayers.txt.tmp");
+        return;
+    }
+    close(fd);
+    if (rename("topPlayers.txt.tmp", "topPlayers.txt") == -1) {
+        fprintf(stderr, "[ERR]: rename failed: %s\n", strerror(errno));
+        unlink("topPlayers.txt.tmp");
+    }
+}
 
-        close(req_rx);
-        close(notif_tx);
-        closedir(level_dir);
+void sig_handler(int sig) {
+    // Se for o sinal de leaderboard, liga uma flag global para iniciar a criaçao da leaderboard
+    if (sig == SIGUSR1) {
+        sigusr1_received = 1;
+    }
+}
 
-        pthread_mutex_destroy(&session->lock);
-        pthread_mutex_lock(&sessions_lock);
-        session->active = false;
-        pthread_mutex_unlock(&sessions_lock);
-        sem_post(&semaforo_clientes);
+// Valida um pedido de registo e tira o id do cliente do nome do seu request pipe
+// Devolve -1 se o pedido for invalido
+static int parse_registration(msg_registration_t *msg_reg, int *client_id) {
+    int parsed = sscanf(msg_reg->req_pipe_path, "/tmp/%d_request", client_id);
+    if (parsed != 1) {
+        fprintf(stderr, "[ERR]: req_pipe parse failed\n");
+        return -1;
     }
-    pthread_exit(NULL);
+    // Um modo desconhecido recebe a board completa
+    if (msg_reg->frame_mode != FRAME_MODE_ENTITIES) msg_reg->frame_mode = FRAME_MODE_GRID;
+    if (msg_reg->transport != TRANSPORT_SHM) msg_reg->transport = TRANSPORT_FIFO;
+    return 0;
 }
 
-int compare_sessions(const void *a, const void *b) {
-    session_t *session_a = *(session_t**)a;
-    session_t *session_b = *(session_t**)b;
+// Descarta um handshake pendente (troca-o com o ultimo da lista)
+static void drop_handshake(int index) {
+    handshake_t *hs = &handshakes[index];
+    if (hs->req_rx != -1) close(hs->req_rx);
+    handshakes[index] = handshakes[--n_handshakes];
+}
 
-    int* b_points_ptr = session_b->points;
-    int* a_points_ptr = session_a->points;
+// Tenta avancar um handshake sem bloquear
+// Devolve 1 se o cliente ficou na fila, 0 se ainda esta a espera e -1 se falhou
+static int advance_handshake(handshake_t *hs, long long now) {
+    if (hs->state == HANDSHAKE_SOCKET_REG) {
+        msg_registration_t msg_reg;
+        ssize_t ret = recv(hs->req_rx, &msg_reg, sizeof(msg_registration_t), 0);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) goto handshake_wait;
+            perror("[ERR]: recv failed");
+            return -1;
+        }
+        // O cliente desligou-se antes de se registar
+        if (ret == 0) return -1;
+        // Cada pacote e uma mensagem inteira
+        if (ret != sizeof(msg_registration_t) || parse_registration(&msg_reg, &hs->client_id) == -1) {
+            fprintf(stderr, "[ERR]: invalid registration packet\n");
+            return -1;
+        }
+        // O socket serve de request e de notif pipe
+        if (enqueue_registration(hs->req_rx, hs->req_rx, hs->client_id, msg_reg.frame_mode, NULL) == -1) {
+            msg_reg_response_t response;
+            response.op_code = OP_CODE_CONNECT;
+            response.result = 1;
+            response.transport = TRANSPORT_SOCKET;
+            fprintf(stderr, "[ERR]: registration queue full, rejecting client %d\n", hs->client_id);
+            send(hs->req_rx, &response, sizeof(msg_reg_response_t), 0);
+            return -1;
+        }
+        hs->req_rx = -1;
+        return 1;
+    }
 
-    // Ordena por pontuaçao decrescente
-    if (*b_points_ptr > *a_points_ptr) return 1;
-    if (*a_points_ptr > *b_points_ptr) return -1;
+    if (hs->state == HANDSHAKE_REQ_OPEN) {
+        // Abrir um FIFO para leitura com O_NONBLOCK nunca bloqueia nem espera por um writer,
+        // por isso este passo acaba sempre logo; o req pipe fica non-blocking daqui em diante
+        // (as jogadas sao lidas sem bloquear, a cada tick)
+        hs->req_rx = open(hs->msg_reg.req_pipe_path, O_RDONLY | O_NONBLOCK);
+        if (hs->req_rx == -1) {
+            perror("[ERR]: req_pipe open failed");
+            return -1;
+        }
+        hs->state = HANDSHAKE_NOTIF_OPEN;
+    }
 
-    // Em caso de empate, ordena por id crescente
-    return session_a->id - session_b->id;
-}
+    if (hs->state == HANDSHAKE_NOTIF_OPEN) {
+        int notif_tx = open(hs->msg_reg.notif_pipe_path, O_WRONLY | O_NONBLOCK);
+        if (notif_tx == -1) {
+            // Se não estiver aberto no client
+            if (errno == ENXIO || errno == EINTR) goto handshake_wait;
+            perror("[ERR]: notif_pipe open failed");
+            return -1;
+        }
+        // O notif pipe fica em O_NONBLOCK: um cliente que nao le nunca bloqueia a thread da sessao
 
-void leaderboard_generator() {
-    // Bloqueia mudanças nas sessoes
-    pthread_mutex_lock(&sessions_lock);
+        // O anel e criado antes de o cliente receber a resposta; se falhar, o cliente fica no notif pipe
+        shm_ring_t *ring = NULL;
+        if (hs->msg_reg.transport == TRANSPORT_SHM) {
+            ring = frame_ring_create(hs->msg_reg.notif_pipe_path);
+        }
 
-    // Copia a informaçao das sessoes ativas
-    session_t* sessions_copy[max_sessions];
-    int count = 0;
-    for (int i = 0; i < max_sessions; i++) {
-        if (sessions[i] != NULL && sessions[i]->active) {
-            sessions_copy[count++] = sessions[i];
+        //Envia o cliente para a fila de registo
+        if (enqueue_registration(hs->req_rx, notif_tx, hs->client_id, hs->msg_reg.frame_mode, ring) == -1) {
+            // Fila cheia: avisa o cliente de que nao foi possivel conectar
+            msg_reg_response_t response;
+            response.op_code = OP_CODE_CONNECT;
+            response.result = 1;
+            response.transport = TRANSPORT_FIFO;
+            fprintf(stderr, "[ERR]: registration queue full, rejecting client %d\n", hs->client_id);
+            write_msg(notif_tx, &response, sizeof(msg_reg_response_t));
+            close(notif_tx);
+            frame_ring_destroy(ring);
+            return -1;
         }
+        hs->req_rx = -1;
+        return 1;
     }
-    // Desbloqueia mudanças nas sessoes
-    pthread_mutex_unlock(&sessions_lock);
 
-    // Organiza as copias das sessoes por pontos (id em caso de empate)
-    qsort(sessions_copy, count, sizeof(session_t*), compare_sessions);
+    handshake_wait:
+    // Um cliente que nunca abre os pipes nao pode ocupar um handshake para sempre
+    if (now - hs->started_ns > HANDSHAKE_TIMEOUT_MS * 1000000LL) {
+        fprintf(stderr, "[ERR]: handshake with client %d timed out\n", hs->client_id);
+        return -1;
+    }
+    return 0;
+}
 
-    // Abre o ficheiro topPlayers.txt, criando-o se nao existir e
-    // apagando os seus conteudos se existir
-    int fd = open("topPlayers.txt", O_CREAT|O_TRUNC|O_WRONLY, 0644);
-    // Garante que nao ha problemas se houver menos clientes conectados
-    // do que o numero maximo de clientes na leaderboard
-    int top_n;
-    if (count < LEADERBOARD_SIZE) {
-        top_n = count;
-    } else top_n = LEADERBOARD_SIZE;
+// Avanca todos os handshakes pendentes; os clientes lentos nao atrasam os outros
+static void advance_handshakes() {
+    long long now = monotonic_ns();
+    int queued = 0;
+    for (int i = 0; i < n_handshakes; ) {
+        int ret = advance_handshake(&handshakes[i], now);
+        if (ret == 0) {
+            i++;
+            continue;
+        }
+        if (ret == 1) queued = 1;
+        drop_handshake(i);
+    }
+    if (queued) admit_clients();
+}
 
-    // Por cada sessao no topo, poe a sua informaçao na leaderboard
-    for (int i = 0; i < top_n; i++) {
-        session_t* session = sessions_copy[i];
-        int * points_ptr = session->points;
-        char line[LINE_MAX];
-        snprintf(line, LINE_MAX ,"ID: %d, Pontos: %d\n",
-                session->id, *points_ptr);
-        int check = write(fd, line, strlen(line));
-        if (check == -1) {
-            fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
+// Acrescenta um handshake a lista de pendentes
+static handshake_t *new_handshake() {
+    if (n_handshakes == handshakes_capacity) {
+        int capacity = handshakes_capacity ? handshakes_capacity * 2 : HANDSHAKES_INITIAL_CAPACITY;
+        handshake_t *list = realloc(handshakes, capacity * sizeof(handshake_t));
+        if (list == NULL) {
+            perror("[ERR]: Memory Exceeded\n");
+            exit(EXIT_FAILURE);
         }
+        handshakes = list;
+        handshakes_capacity = capacity;
     }
+    handshake_t *hs = &handshakes[n_handshakes++];
+    hs->started_ns = monotonic_ns();
+    return hs;
+}
 
-    close(fd);
+// Comeca o handshake de um cliente que pediu para se registar
+static void handle_registration(msg_registration_t *msg_reg) {
+    int client_id;
+    if (parse_registration(msg_reg, &client_id) == -1) return;
+
+    handshake_t *hs = new_handshake();
+    hs->msg_reg = *msg_reg;
+    hs->client_id = client_id;
+    hs->req_rx = -1;
+    hs->state = HANDSHAKE_REQ_OPEN;
 }
 
-void sig_handler(int sig) {
-    // Se for o sinal de leaderboard, liga uma flag global para iniciar a criaçao da leaderboard
-    if (sig == SIGUSR1) {
-        sigusr1_received = 1;
+// Aceita todas as ligacoes pendentes no socket; cada uma fica a espera do seu pacote de registo
+static void accept_connections(int epoll_fd, int listen_fd) {
+    while (true) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("[ERR]: accept failed");
+            return;
+        }
+        int flags = fcntl(conn, F_GETFL, 0);
+        fcntl(conn, F_SETFL, flags | O_NONBLOCK);
+        int sndbuf = SOCKET_SNDBUF;
+        if (setsockopt(conn, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == -1) {
+            perror("[ERR]: setsockopt(SO_SNDBUF) failed");
+        }
+
+        // O pacote de registo acorda o epoll uma unica vez; depois o socket passa para a sessao
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.fd = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn, &ev) == -1) {
+            perror("[ERR]: epoll_ctl failed");
+            close(conn);
+            continue;
+        }
+
+        handshake_t *hs = new_handshake();
+        hs->client_id = -1;
+        hs->req_rx = conn;
+        hs->state = HANDSHAKE_SOCKET_REG;
     }
 }
 
-void hosting(int reg_rx,char *reg_pipe_pathname) {
+// Le todos os pedidos de registo que estao no pipe de registo
+static void drain_registrations(int reg_rx) {
     while (true) {
-        // Result = 0 se esta tudo bem, = 1 se ocorrerem erros
-        int result = 0;
-        // Se a global flag de criaçao de leaderboard estiver ativa, chama-se funçao de criaçao de leaderboard
-        if (sigusr1_received) {
-            sigusr1_received = 0;
-            leaderboard_generator();
-        }
         msg_registration_t msg_reg;
         ssize_t ret = read(reg_rx, &msg_reg, sizeof(msg_registration_t));
-        // Se não houver clients conectados/não há mais mensagens por ler
-        if (ret == 0) {
-            // Fecha e volta a abrir o pipe, para previnir que ele se prenda no EOF
-            close(reg_rx);
-            do {
-                reg_rx = open(reg_pipe_pathname, O_RDONLY | O_NONBLOCK);
-            } while (reg_rx == -1 && errno == EINTR);
-            continue;
-
-        } if (ret == -1) {
+        if (ret == -1) {
             // Se for interrompido por um sinal nao considera erro
-            if (errno == EINTR) {
-                continue;
-            }
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Sem dados disponíveis, espera um pouco
-                sleep_ms(100);
-                continue;
-            }
+            if (errno == EINTR) continue;
+            // Ja nao ha mais pedidos por ler
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
             fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
+            return;
+        }
+        // O servidor mantem o pipe aberto para escrita, por isso nunca ha EOF
+        if (ret == 0) return;
+        // As mensagens de registo sao escritas de forma atomica (< PIPE_BUF)
+        if (ret != sizeof(msg_registration_t)) {
+            fprintf(stderr, "[ERR]: truncated registration message\n");
             continue;
         }
+        handle_registration(&msg_reg);
+    }
+}
 
-        int req_rx = 0;
+// listen_fd e o socket de escuta, ou -1 se o server so aceita registos pelo FIFO
+void hosting(int reg_rx, int listen_fd) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("[ERR]: epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
 
-        // Loop para abrir o request pipe
-        while (true) {
-            req_rx = open(msg_reg.req_pipe_path, O_RDONLY | O_NONBLOCK);
-            if (req_rx == -1 && errno == ENXIO) {
-                // Se for incapaz de abrir espera para o client o abrir
-                sleep_ms(100);
-            }
-            else if (req_rx == -1) {
-                perror("[ERR]: req_pipe open failed");
-                result = 1;
-                break;
-            } else {
-                break;
-            }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = reg_rx;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reg_rx, &ev) == -1) {
+        perror("[ERR]: epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    if (listen_fd != -1) {
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+            perror("[ERR]: epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // O SIGUSR1 so e entregue dentro do epoll_pwait, para que a flag nunca
+    // seja ligada entre a verificacao e a espera
+    sigset_t block_mask, wait_mask;
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &wait_mask);
+    sigdelset(&wait_mask, SIGUSR1);
 
+    while (true) {
+        // Se a global flag de criaçao de leaderboard estiver ativa, chama-se funçao de criaçao de leaderboard
+        if (sigusr1_received) {
+            sigusr1_received = 0;
+            leaderboard_generator();
         }
-        if (result==1) continue;
-        // Remove O_NONBLOCK do req pipe depois de o abrir
-        int flags = fcntl(req_rx, F_GETFL, 0);
-        fcntl(req_rx, F_SETFL, flags & ~O_NONBLOCK);
 
-        int notif_tx = 0;
-        // Loop para abrir o notif pipe
-        while (true) {
-            notif_tx = open(msg_reg.notif_pipe_path, O_WRONLY | O_NONBLOCK);
-            // Se não estiver aberto no client
-            if (notif_tx == -1 && errno == ENXIO) {
-                sleep_ms(100);
-            }
-            else if (notif_tx == -1) {
-                perror("[ERR]: req_pipe open failed");
-                result = 1;
-                break;
-            } else {
-                break;
+        // Espera sem gastar CPU ate chegar um pedido de registo ou um sinal.
+        // Os opens dos FIFOs nao geram eventos, por isso enquanto houver
+        // handshakes pendentes acorda periodicamente para os voltar a tentar
+        // (os pacotes de registo dos sockets acordam o epoll)
+        struct epoll_event events[8];
+        int timeout = n_handshakes > 0 ? HANDSHAKE_RETRY_MS : -1;
+        int n = epoll_pwait(epoll_fd, events, 8, timeout, &wait_mask);
+        if (n == -1) {
+            // Se for interrompido por um sinal nao considera erro
+            if (errno == EINTR) continue;
+            perror("[ERR]: epoll_wait failed");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == reg_rx) {
+                drain_registrations(reg_rx);
+            } else if (events[i].data.fd == listen_fd) {
+                accept_connections(epoll_fd, listen_fd);
             }
-
         }
-        if (result==1) continue;
+        advance_handshakes();
+    }
+}
 
-        // Remove O_NONBLOCK do notif pipe depois de o abrir
-        flags = fcntl(notif_tx, F_GETFL, 0);
-        fcntl(notif_tx, F_SETFL, flags & ~O_NONBLOCK);
 
-        int client_id;
-        int parsed = sscanf(msg_reg.req_pipe_path, "/tmp/%d_request", &client_id);
-        if (parsed != 1) {
-            perror("[ERR]: req_pipe parse failed");
-            pthread_exit(NULL);
-        }
 
-        //Envia o cliente para a fila de registo
-        enqueue_registration(req_rx, notif_tx, client_id);
+// Cria o socket de escuta em path (um pacote por mensagem, uma ligacao por cliente)
+static int open_listener(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[ERR]: socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
 
+    //(preventivo) se o socket ja existe, apaga-o
+    if (unlink(path) != 0 && errno != ENOENT) {
+        perror("[ERR]: unlink failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+        perror("[ERR]: socket failed\n");
+        exit(EXIT_FAILURE);
     }
-    pthread_exit(NULL);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror("[ERR]: bind failed\n");
+        exit(EXIT_FAILURE);
+    }
+    // O accept e non-blocking: o hosting espera pelas ligacoes no epoll
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return fd;
 }
 
-
-
 int main(int argc, char** argv) {
     // Garante que os parametros de execuçao do server sao respeitados
-    if (argc != 4) {
-        printf("Usage: %s <level_directory> <max_games> <nome_do_FIFO_de_registo>\n", argv[0]);
+    if (argc != 4 && argc != 5) {
+        printf("Usage: %s <level_directory> <max_games> <nome_do_FIFO_de_registo> [socket_de_registo]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -906,6 +1355,16 @@ int main(int argc, char** argv) {
         exit(EXIT_FAILURE);
     }
 
+    // Escrever para um cliente que fechou o notif pipe devolve EPIPE em vez de terminar o server
+    struct sigaction sa_pipe;
+    sa_pipe.sa_handler = SIG_IGN;
+    sigemptyset(&sa_pipe.sa_mask);
+    sa_pipe.sa_flags = 0;
+    if (sigaction(SIGPIPE, &sa_pipe, NULL) == -1) {
+        perror("sigaction failed");
+        exit(EXIT_FAILURE);
+    }
+
     int max_games = atoi(argv[2]);
     // Guarda max_games numa variavel global
     max_sessions = max_games;
@@ -915,12 +1374,15 @@ int main(int argc, char** argv) {
         perror("Memory Exceeded\n");
         exit(EXIT_FAILURE);
     }
-    // Inicializa os membros da lista
+    // Pre-aloca as sessoes; sao reaproveitadas pelos clientes seguintes
     for (int i = 0; i < max_games; i++) {
-        sessions[i] = NULL;
+        sessions[i] = calloc(1, sizeof(session_t));
+        if (sessions[i] == NULL){
+            perror("Memory Exceeded\n");
+            exit(EXIT_FAILURE);
+        }
     }
-    // Inicializa semaforo
-    sem_init(&semaforo_clientes, 0, max_games);
+    init_registration_queue();
     open_debug_file("debug.log");
 
     char* reg_pipe_pathname = argv[3];
@@ -938,52 +1400,51 @@ int main(int argc, char** argv) {
 
     }
 
-    int reg_rx = open(reg_pipe_pathname, O_RDONLY);
+    // O read e non-blocking: o hosting espera pelos pedidos no epoll
+    int reg_rx = open(reg_pipe_pathname, O_RDONLY | O_NONBLOCK);
     if (reg_rx == -1) {
         perror("[ERR]: open failed\n");
         exit(EXIT_FAILURE);
     }
+    // O servidor mantem o pipe aberto para escrita para que o read nunca veja EOF
+    // quando os clientes fecham o seu lado (evita ter de fechar e reabrir o pipe)
+    int reg_keepalive = open(reg_pipe_pathname, O_WRONLY);
+    if (reg_keepalive == -1) {
+        perror("[ERR]: open failed\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Torna read non-blocking (nao impede a funçao de continuar)
-    int flags = fcntl(reg_rx, F_GETFL, 0);
-    fcntl(reg_rx, F_SETFL, flags | O_NONBLOCK);
+    // Opcional: os clientes podem ligar-se por um socket SOCK_SEQPACKET em vez dos FIFOs
+    int listen_fd = -1;
+    if (argc == 5) {
+        listen_fd = open_listener(argv[4]);
+    }
 
-    // Aloca memoria para os ids das sessoes
-    pthread_t *session_tids = malloc(max_games * sizeof(pthread_t));
-    if (session_tids == NULL){
-        perror("[ERR]: Memory Exceeded\n");
+    strcpy(level_directory, argv[1]);
+    // Todos os niveis sao lidos uma so vez e partilhados pelas sessoes; alteracoes a diretoria
+    // sao recarregadas em fundo e valem para os jogos seguintes
+    if (level_playlist_init(level_directory) == -1) {
+        fprintf(stderr, "Failed to open directory\n");
         exit(EXIT_FAILURE);
     }
-    // Cria as sessoes
-    for (int i = 0; i < max_games; i++) {
-        // Aloca memoria para as sessoes
-        session_thread_arg_t *s_arg = malloc(sizeof(session_thread_arg_t));
-        if (s_arg == NULL){
-            perror("[ERR]: Memory Exceeded\n");
-            exit(EXIT_FAILURE);
-        }
-        strcpy(s_arg->directory_name, argv[1]);
-        // Cria as threads que tratam as sessoes
-        int ret = pthread_create(&session_tids[i], NULL, session_thread, (void*) s_arg);
-        if (ret == -1){
-            perror("[ERR]: Failed to create session thread\n");
-            exit(EXIT_FAILURE);
-        }
+    // Gera uma seed para os movimentos aleatorios
+    srand((unsigned int)time(NULL));
+
+    // Cria o pool de workers que corre todas as sessoes
+    if (scheduler_start(scheduler_default_workers()) == -1) {
+        exit(EXIT_FAILURE);
     }
 
     // Inicia a funçao de hosting
-    hosting(reg_rx, argv[3]);
+    hosting(reg_rx, listen_fd);
+    close(reg_keepalive);
+    if (listen_fd != -1) close(listen_fd);
 
-    for (int i = 0; i < max_games; i++) {
-        pthread_cancel(session_tids[i]);
-    }
     for (int i=0; i < max_games; i++) {
-        if (sessions[i] != NULL) {
-            free(sessions[i]);
-        }
+        free(sessions[i]);
     }
-    free(session_tids);
     free(sessions);
+    level_playlist_stop();
 
     close_debug_file();
     return 0;
@@ -0,0 +1,523 @@
+#include "level.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+// Alinhamento dos dados no pack (os bit-planes sao lidos como uint64_t)
+#define PACK_ALIGN 8
+
+// Tempo sem novos eventos na diretoria antes de recarregar (junta as escritas de uma atualizacao)
+#define RELOAD_QUIET_MS 200
+
+// Playlist atual; o lock so protege a troca do ponteiro com a tomada de uma referencia
+static level_cache_t *playlist = NULL;
+static pthread_mutex_t playlist_lock = PTHREAD_MUTEX_INITIALIZER;
+static char playlist_dir[MAX_FILENAME];
+static pthread_t watcher;
+static bool watching = false;
+static int watcher_stop_fd = -1;    // eventfd escrito pelo level_playlist_stop para acordar o watcher
+
+static level_cache_t *new_cache(void) {
+    level_cache_t *cache = calloc(1, sizeof(level_cache_t));
+    if (cache == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&cache->refs, 1);
+    return cache;
+}
+
+// Ordem natural dos nomes: os numeros comparam-se pelo valor, por isso 2.lvl vem antes de 10.lvl
+static int level_name_cmp(const void *a, const void *b) {
+    const char *x = *(char * const *)a;
+    const char *y = *(char * const *)b;
+    while (*x != '\0' && *y != '\0') {
+        if (isdigit((unsigned char)*x) && isdigit((unsigned char)*y)) {
+            char *x_end, *y_end;
+            unsigned long nx = strtoul(x, &x_end, 10);
+            unsigned long ny = strtoul(y, &y_end, 10);
+            if (nx != ny) return nx < ny ? -1 : 1;
+            x = x_end;
+            y = y_end;
+            continue;
+        }
+        if (*x != *y) return (unsigned char)*x - (unsigned char)*y;
+        x++;
+        y++;
+    }
+    return (unsigned char)*x - (unsigned char)*y;
+}
+
+level_cache_t *level_cache_load_text(const char *dirname) {
+    DIR *dir = opendir(dirname);
+    if (dir == NULL) return NULL;
+
+    // Primeiro junta os nomes dos niveis, para os jogar por ordem e nao pela do readdir
+    char **names = NULL;
+    int n_names = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        char *dot = strrchr(entry->d_name, '.');
+        if (!dot || strcmp(dot, ".lvl") != 0) continue;
+
+        if (n_names == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (grown == NULL) {
+                perror("Memory Exceeded");
+                exit(EXIT_FAILURE);
+            }
+            names = grown;
+        }
+        names[n_names] = strdup(entry->d_name);
+        if (names[n_names] == NULL) {
+            perror("Memory Exceeded");
+            exit(EXIT_FAILURE);
+        }
+        n_names++;
+    }
+    closedir(dir);
+    qsort(names, n_names, sizeof(char *), level_name_cmp);
+
+    level_cache_t *cache = new_cache();
+    cache->levels = calloc(n_names ? n_names : 1, sizeof(board_t));
+    if (cache->levels == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n_names; i++) {
+        board_t *level = &cache->levels[cache->n_levels];
+        memset(level, 0, sizeof(board_t));
+        if (load_level(level, names[i], (char *)dirname, 0) == 0) {
+            debug("Cached level %s: %d x %d, %d ghosts\n", level->level_name, level->width, level->height, level->n_ghosts);
+            cache->n_levels++;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    return cache;
+}
+
+// Verifica que [offset, offset + len) esta dentro do pack e alinhado
+static int pack_range_ok(uint64_t offset, uint64_t len, uint64_t size) {
+    return offset % PACK_ALIGN == 0 && offset <= size && len <= size - offset;
+}
+
+static bool position_ok(const board_t *level, int x, int y) {
+    return x >= 0 && x < level->width && y >= 0 && y < level->height;
+}
+
+// Verifica um guiao de movimentos: comandos conhecidos, numero de jogadas e movimento atual dentro dos limites
+static bool moves_ok(const command_t *moves, int n_moves, int current_move) {
+    if (n_moves < 0 || n_moves > MAX_MOVES || current_move < 0) return false;
+    // Sem movimentos o guiao nunca e indexado (ghosts_phase salta-o)
+    if (n_moves == 0) return current_move == 0;
+    if (current_move >= n_moves) return false;
+    for (int m = 0; m < n_moves; m++) {
+        if (moves[m].command == '\0' || strchr("ADWSRCT", moves[m].command) == NULL) return false;
+        if (moves[m].turns < 1 || moves[m].turns_left < 0 || moves[m].turns_left > moves[m].turns) return false;
+    }
+    return true;
+}
+
+// Verifica as entidades de um nivel do pack: posicoes dentro do board e guioes validos
+static bool entities_ok(const board_t *level) {
+    for (int p = 0; p < level->n_pacmans; p++) {
+        const pacman_t *pacman = &level->pacmans[p];
+        if (!position_ok(level, pacman->pos_x, pacman->pos_y) || pacman->passo < 0 ||
+            !moves_ok(pacman->moves, pacman->n_moves, pacman->current_move)) return false;
+    }
+    for (int g = 0; g < level->n_ghosts; g++) {
+        const ghost_t *ghost = &level->ghosts[g];
+        if (!position_ok(level, ghost->pos_x, ghost->pos_y) || ghost->passo < 0 ||
+            !moves_ok(ghost->moves, ghost->n_moves, ghost->current_move)) return false;
+    }
+    return true;
+}
+
+// Mapeia o pack e aponta os templates para os seus dados, sem copiar nem interpretar texto
+// Devolve NULL se nao ha pack ou se ele nao e valido (os niveis sao entao lidos do texto)
+static level_cache_t *load_pack(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(level_pack_header_t)) {
+        debug("Level pack %s is too short\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    // So de leitura: as paginas sao as da page cache, partilhadas por todas as sessoes e processos
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        debug("Failed to map level pack %s\n", path);
+        return NULL;
+    }
+
+    const level_pack_header_t *header = (const level_pack_header_t *)map;
+    if (memcmp(header->magic, LEVEL_PACK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != LEVEL_PACK_VERSION || header->size != size ||
+        !pack_range_ok(sizeof(level_pack_header_t), (uint64_t)header->n_levels * sizeof(level_pack_entry_t), size)) {
+        debug("Level pack %s is invalid or from another version\n", path);
+        munmap(map, size);
+        return NULL;
+    }
+
+    level_cache_t *cache = new_cache();
+    cache->pack = map;
+    cache->pack_size = size;
+    cache->levels = calloc(header->n_levels ? header->n_levels : 1, sizeof(board_t));
+    if (cache->levels == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+
+    const level_pack_entry_t *entries = (const level_pack_entry_t *)(map + sizeof(level_pack_header_t));
+    for (uint32_t i = 0; i < header->n_levels; i++) {
+        const level_pack_entry_t *entry = &entries[i];
+        board_t *level = &cache->levels[i];
+        level->width = entry->width;
+        level->height = entry->height;
+        level->tempo = entry->tempo;
+        level->n_pacmans = entry->n_pacmans;
+        level->n_ghosts = entry->n_ghosts;
+
+        if (entry->width <= 0 || entry->height <= 0 || entry->width > INT_MAX / entry->height ||
+            entry->tempo < 0 || entry->n_pacmans < 1 ||
+            entry->n_ghosts < 0 || entry->n_ghosts > MAX_GHOSTS ||
+            !pack_range_ok(entry->cells, (uint64_t)entry->width * entry->height, size) ||
+            !pack_range_ok(entry->layers, layers_size(level), size) ||
+            !pack_range_ok(entry->pacmans, (uint64_t)entry->n_pacmans * sizeof(pacman_t), size) ||
+            !pack_range_ok(entry->ghosts, (uint64_t)entry->n_ghosts * sizeof(ghost_t), size)) {
+            goto corrupted;
+        }
+
+        snprintf(level->level_name, sizeof(level->level_name), "%.*s", (int)sizeof(entry->name), entry->name);
+        // O mapeamento e PROT_READ: um template nunca e escrito, so copiado por copy_level
+        level->board = (board_pos_t *)(map + entry->cells);
+        level->pacmans = (pacman_t *)(map + entry->pacmans);
+        level->ghosts = (ghost_t *)(map + entry->ghosts);
+        attach_layers(level, (uint64_t *)(map + entry->layers));
+        // Os jogos indexam o board e os movimentos diretamente com estes valores
+        if (!entities_ok(level)) goto corrupted;
+        debug("Mapped level %s: %d x %d, %d ghosts\n", level->level_name, level->width, level->height, level->n_ghosts);
+        cache->n_levels++;
+        continue;
+
+    corrupted:
+        debug("Level pack %s: level %u is corrupted\n", path, i);
+        free(cache->levels);
+        free(cache);
+        munmap(map, size);
+        return NULL;
+    }
+
+    return cache;
+}
+
+// Ficheiros que nao fazem parte dos niveis (temporarios do level_pack, logs e escondidos)
+static bool ignored_file(const char *name) {
+    const char *dot = strrchr(name, '.');
+    if (name[0] == '.') return true;
+    return dot != NULL && (strcmp(dot, ".tmp") == 0 || strcmp(dot, ".log") == 0);
+}
+
+// Se a data time e posterior a do pack
+static bool newer_than(const struct timespec *time, const struct timespec *pack_time) {
+    return time->tv_sec > pack_time->tv_sec ||
+           (time->tv_sec == pack_time->tv_sec && time->tv_nsec > pack_time->tv_nsec);
+}
+
+// Verifica se algum ficheiro de texto da diretoria foi alterado depois de o pack ser escrito
+// A data da propria diretoria apanha os niveis acrescentados, apagados ou renomeados
+static bool text_newer_than(const char *dirname, const struct timespec *pack_time) {
+    struct stat dir_st;
+    if (stat(dirname, &dir_st) == 0 && newer_than(&dir_st.st_mtim, pack_time)) {
+        debug("Level directory %s changed after the level pack, reading the text files\n", dirname);
+        return true;
+    }
+    DIR *dir = opendir(dirname);
+    if (dir == NULL) return false;
+
+    bool newer = false;
+    struct dirent *entry;
+    while (!newer && (entry = readdir(dir)) != NULL) {
+        if (ignored_file(entry->d_name) || strcmp(entry->d_name, LEVEL_PACK_FILE) == 0) continue;
+
+        char path[MAX_FILENAME * 2];
+        snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) continue;
+        if (newer_than(&st.st_mtim, pack_time)) {
+            debug("Level file %s is newer than the level pack, reading the text files\n", entry->d_name);
+            newer = true;
+        }
+    }
+    closedir(dir);
+    return newer;
+}
+
+level_cache_t *level_cache_load(const char *dirname) {
+    char path[MAX_FILENAME + sizeof(LEVEL_PACK_FILE) + 1];
+    snprintf(path, sizeof(path), "%s/%s", dirname, LEVEL_PACK_FILE);
+
+    // Um pack mais antigo do que os ficheiros de texto esta desatualizado: as alteracoes aos niveis
+    // (e os reloads do watcher) valem logo, ate o level_pack voltar a ser corrido
+    struct stat st;
+    if (stat(path, &st) == -1 || text_newer_than(dirname, &st.st_mtim)) {
+        return level_cache_load_text(dirname);
+    }
+
+    level_cache_t *cache = load_pack(path);
+    if (cache != NULL) return cache;
+    return level_cache_load_text(dirname);
+}
+
+void level_cache_free(level_cache_t *cache) {
+    if (cache == NULL) return;
+    if (cache->pack != NULL) {
+        // Os dados dos templates estao no mapeamento
+        munmap(cache->pack, cache->pack_size);
+    } else {
+        for (int i = 0; i < cache->n_levels; i++) {
+            unload_level(&cache->levels[i]);
+        }
+    }
+    free(cache->levels);
+    free(cache);
+}
+
+void level_cache_release(level_cache_t *cache) {
+    if (cache == NULL) return;
+    if (atomic_fetch_sub(&cache->refs, 1) == 1) {
+        debug("Freeing a level cache of %d levels\n", cache->n_levels);
+        level_cache_free(cache);
+    }
+}
+
+// Reserva len bytes alinhados no fim do pack e devolve o seu offset
+static uint64_t pack_reserve(uint64_t *size, uint64_t len) {
+    uint64_t offset = (*size + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+    *size = offset + len;
+    return offset;
+}
+
+int level_pack_write(const level_cache_t *cache, const char *path) {
+    // Primeiro calcula o layout, depois preenche um buffer com o ficheiro inteiro
+    uint64_t size = sizeof(level_pack_header_t) + (uint64_t)cache->n_levels * sizeof(level_pack_entry_t);
+    level_pack_entry_t *entries = calloc(cache->n_levels ? cache->n_levels : 1, sizeof(level_pack_entry_t));
+    if (entries == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < cache->n_levels; i++) {
+        const board_t *level = &cache->levels[i];
+        level_pack_entry_t *entry = &entries[i];
+        snprintf(entry->name, sizeof(entry->name), "%s", level->level_name);
+        entry->width = level->width;
+        entry->height = level->height;
+        entry->tempo = level->tempo;
+        entry->n_pacmans = level->n_pacmans;
+        entry->n_ghosts = level->n_ghosts;
+        entry->cells = pack_reserve(&size, (uint64_t)level->width * level->height);
+        entry->layers = pack_reserve(&size, layers_size(level));
+        entry->pacmans = pack_reserve(&size, (uint64_t)level->n_pacmans * sizeof(pacman_t));
+        entry->ghosts = pack_reserve(&size, (uint64_t)level->n_ghosts * sizeof(ghost_t));
+    }
+
+    char *buf = calloc(1, size);
+    if (buf == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    level_pack_header_t *header = (level_pack_header_t *)buf;
+    memcpy(header->magic, LEVEL_PACK_MAGIC, sizeof(header->magic));
+    header->version = LEVEL_PACK_VERSION;
+    header->n_levels = (uint32_t)cache->n_levels;
+    header->size = size;
+    memcpy(buf + sizeof(level_pack_header_t), entries, (size_t)cache->n_levels * sizeof(level_pack_entry_t));
+
+    for (int i = 0; i < cache->n_levels; i++) {
+        const board_t *level = &cache->levels[i];
+        const level_pack_entry_t *entry = &entries[i];
+        memcpy(buf + entry->cells, level->board, (size_t)level->width * level->height);
+        memcpy(buf + entry->layers, level->layers, layers_size(level));
+        // Os pontos do pacman sao os do jogo e sao postos por copy_level
+        pacman_t *pacmans = (pacman_t *)(buf + entry->pacmans);
+        memcpy(pacmans, level->pacmans, level->n_pacmans * sizeof(pacman_t));
+        for (int p = 0; p < level->n_pacmans; p++) pacmans[p].points = 0;
+        memcpy(buf + entry->ghosts, level->ghosts, level->n_ghosts * sizeof(ghost_t));
+    }
+    free(entries);
+
+    // Escreve para um ficheiro temporario e troca-o de uma vez: o server nunca ve um pack a meio
+    char tmp_path[MAX_FILENAME + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free(buf);
+        return -1;
+    }
+    uint64_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, buf + written, size - written);
+        if (n == -1) {
+            close(fd);
+            unlink(tmp_path);
+            free(buf);
+            return -1;
+        }
+        written += (uint64_t)n;
+    }
+    free(buf);
+    if (close(fd) == -1 || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    // O rename altera a data da diretoria; o pack fica com uma data nao anterior, para nao parecer desatualizado
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return 0;
+}
+
+// Troca a playlist: os jogos que ja comecaram ficam com a versao que tinham
+static void playlist_swap(level_cache_t *cache) {
+    pthread_mutex_lock(&playlist_lock);
+    level_cache_t *old = playlist;
+    playlist = cache;
+    pthread_mutex_unlock(&playlist_lock);
+    level_cache_release(old);
+}
+
+// Le os eventos pendentes do inotify; devolve se algum diz respeito aos niveis
+static bool drain_events(int fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool relevant = false;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) relevant = true;
+            if (event->len > 0 && !ignored_file(event->name)) relevant = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return relevant;
+}
+
+// Thread que vigia a diretoria e recarrega os niveis quando mudam, fora das threads dos jogos
+static void *watch_levels(void *arg) {
+    int fd = *(int *)arg;
+    free(arg);
+    // Dorme ate haver eventos na diretoria ou um pedido para terminar
+    struct pollfd pfds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = watcher_stop_fd, .events = POLLIN },
+    };
+    bool changed = false;
+
+    while (true) {
+        // Depois de uma alteracao espera que a diretoria fique quieta antes de recarregar
+        int ready = poll(pfds, 2, changed ? RELOAD_QUIET_MS : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("[ERR]: poll failed");
+            break;
+        }
+        if (pfds[1].revents) break;
+        if (ready > 0) {
+            if (drain_events(fd)) changed = true;
+            continue;
+        }
+        if (!changed) continue;
+        changed = false;
+
+        level_cache_t *cache = level_cache_load(playlist_dir);
+        if (cache == NULL) {
+            debug("Level directory %s can no longer be read, keeping the current levels\n", playlist_dir);
+            continue;
+        }
+        debug("Reloaded %d levels from %s\n", cache->n_levels, playlist_dir);
+        playlist_swap(cache);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+int level_playlist_init(const char *dirname) {
+    snprintf(playlist_dir, sizeof(playlist_dir), "%s", dirname);
+    level_cache_t *cache = level_cache_load(playlist_dir);
+    if (cache == NULL) return -1;
+    playlist_swap(cache);
+
+    // Sem inotify o server continua, mas so com os niveis lidos agora
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1 || inotify_add_watch(fd, playlist_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1) {
+        perror("[ERR]: inotify failed, levels will not be reloaded");
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    watcher_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (watcher_stop_fd == -1) {
+        perror("[ERR]: eventfd failed, levels will not be reloaded");
+        close(fd);
+        return 0;
+    }
+    int *arg = malloc(sizeof(int));
+    if (arg == NULL) {
+        perror("Memory Exceeded");
+        exit(EXIT_FAILURE);
+    }
+    *arg = fd;
+    if (pthread_create(&watcher, NULL, watch_levels, arg) != 0) {
+        fprintf(stderr, "[ERR]: failed to start the level watcher\n");
+        free(arg);
+        close(fd);
+        close(watcher_stop_fd);
+        watcher_stop_fd = -1;
+        return 0;
+    }
+    watching = true;
+    return 0;
+}
+
+level_cache_t *level_playlist_acquire(void) {
+    pthread_mutex_lock(&playlist_lock);
+    level_cache_t *cache = playlist;
+    if (cache != NULL) atomic_fetch_add(&cache->refs, 1);
+    pthread_mutex_unlock(&playlist_lock);
+    return cache;
+}
+
+void level_playlist_stop(void) {
+    if (watching) {
+        uint64_t one = 1;
+        if (write(watcher_stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("[ERR]: failed to stop the level watcher");
+        }
+        pthread_join(watcher, NULL);
+        close(watcher_stop_fd);
+        watcher_stop_fd = -1;
+        watching = false;
+    }
+    playlist_swap(NULL);
+}
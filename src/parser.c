@@ -6,6 +6,112 @@
 #include "board.h"
 #include "debug.h"
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+The files are mapped read-only once and scanned in place: a line or a token is a range of the mapping,
+never copied or modified, so the scanner keeps no hidden state and sessions can load levels concurrently.
+*/
+
+// Range of characters of a mapped file (a whole file, a line or a token)
+typedef struct {
+    const char *p;
+    const char *end;
+} span_t;
+
+typedef struct {
+    void *map;
+    size_t size;
+} text_file_t;
+
+static int open_text(text_file_t *file, const char *path, span_t *text) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        debug("Error opening file %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        debug("Error reading file %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    file->size = (size_t)st.st_size;
+    file->map = NULL;
+    if (file->size > 0) {
+        file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->map == MAP_FAILED) {
+            debug("Error mapping file %s\n", path);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    text->p = file->map;
+    text->end = text->p + file->size;
+    return 0;
+}
+
+static void close_text(text_file_t *file) {
+    if (file->map) munmap(file->map, file->size);
+}
+
+/*Takes the next line off text, without the '\n' (nor a '\r' before it). Returns 0 at the end of text*/
+static int next_line(span_t *text, span_t *line) {
+    if (text->p >= text->end) return 0;
+
+    const char *nl = memchr(text->p, '\n', (size_t)(text->end - text->p));
+    line->p = text->p;
+    line->end = nl ? nl : text->end;
+    text->p = nl ? nl + 1 : text->end;
+
+    if (line->end > line->p && line->end[-1] == '\r') line->end--;
+    return 1;
+}
+
+/*Lines without content: empty or comments*/
+static int skip_line(const span_t *line) {
+    return line->p == line->end || line->p[0] == '#';
+}
+
+/*Takes the next token separated by spaces or tabs off line. Returns 0 if there is none*/
+static int next_token(span_t *line, span_t *token) {
+    while (line->p < line->end && (*line->p == ' ' || *line->p == '\t')) line->p++;
+    if (line->p == line->end) return 0;
+
+    token->p = line->p;
+    while (line->p < line->end && *line->p != ' ' && *line->p != '\t') line->p++;
+    token->end = line->p;
+    return 1;
+}
+
+static int token_is(const span_t *token, const char *word) {
+    size_t len = strlen(word);
+    return (size_t)(token->end - token->p) == len && memcmp(token->p, word, len) == 0;
+}
+
+/*Integer at the start of the token, like atoi*/
+static int token_int(const span_t *token) {
+    const char *c = token->p;
+    int sign = 1, value = 0;
+    if (c < token->end && (*c == '-' || *c == '+')) {
+        if (*c == '-') sign = -1;
+        c++;
+    }
+    for (; c < token->end && *c >= '0' && *c <= '9'; c++) {
+        value = value * 10 + (*c - '0');
+    }
+    return sign * value;
+}
+
+/*Length of a line or token, to print it with "%.*s"*/
+static int span_len(const span_t *token) {
+    return (int)(token->end - token->p);
+}
 
 int read_level(board_t* board, char* filename, char* dirname) {
 
@@ -14,13 +120,9 @@ int read_level(board_t* board, char* filename, char* dirname) {
     strcat(fullname, "/");
     strcat(fullname, filename);
 
-    int fd = open(fullname, O_RDONLY);
-    if (fd == -1) {
-        debug("Error opening file %s\n", fullname);
-        return -1;
-    }
-    
-    char command[MAX_COMMAND_LENGTH];
+    text_file_t file;
+    span_t text, line, word;
+    if (open_text(&file, fullname, &text) == -1) return -1;
 
     // Pacman is optional
     board->pacman_file[0] = '\0';
@@ -29,49 +131,43 @@ int read_level(board_t* board, char* filename, char* dirname) {
     strcpy(board->level_name, filename);
     *strrchr(board->level_name, '.') = '\0';
 
-    int read;
-    while ((read = read_line(fd, command)) > 0) {
-        if (read == -1){
-            debug("Error reading command\n");
-            close(fd);
-            return -1;
-        }
-        if (command[0] == '#' || command[0] == '\0') continue;
+    int has_line;
+    while ((has_line = next_line(&text, &line))) {
+        if (skip_line(&line)) continue;
 
-        char *word = strtok(command, " \t\n");
-        if (!word) continue;  // skip empty line
+        span_t args = line;
+        if (!next_token(&args, &word)) continue;  // skip blank line
 
-        if (strcmp(word, "DIM") == 0) {
-            char *arg1 = strtok(NULL, " \t\n");
-            char *arg2 = strtok(NULL, " \t\n");
-            if (arg1 && arg2) {
-                board->width = atoi(arg1);
-                board->height = atoi(arg2);
+        if (token_is(&word, "DIM")) {
+            span_t arg1, arg2;
+            if (next_token(&args, &arg1) && next_token(&args, &arg2)) {
+                board->width = token_int(&arg1);
+                board->height = token_int(&arg2);
                 debug("DIM = %d x %d\n", board->width, board->height);
             }
         }
 
-        else if (strcmp(word, "TEMPO") == 0) {
-            char *arg = strtok(NULL, " \t\n");
-            if (arg) {
-                board->tempo = atoi(arg);
+        else if (token_is(&word, "TEMPO")) {
+            span_t arg;
+            if (next_token(&args, &arg)) {
+                board->tempo = token_int(&arg);
                 debug("TEMPO = %d\n", board->tempo);
             }
         }
 
-        else if (strcmp(word, "PAC") == 0) {
-            char *arg = strtok(NULL, " \t\n");
-            if (arg) {
-                snprintf(board->pacman_file, sizeof(board->pacman_file), "%s/%s", dirname, arg);
+        else if (token_is(&word, "PAC")) {
+            span_t arg;
+            if (next_token(&args, &arg)) {
+                snprintf(board->pacman_file, sizeof(board->pacman_file), "%s/%.*s", dirname, span_len(&arg), arg.p);
                 debug("PAC = %s\n", board->pacman_file);
             }
         }
 
-        else if (strcmp(word, "MON") == 0) {
-            char *arg;
+        else if (token_is(&word, "MON")) {
+            span_t arg;
             int i = 0;
-            while ((arg = strtok(NULL, " \t\n")) != NULL) {
-                snprintf(board->ghosts_files[i], sizeof(board->ghosts_files[0]), "%s/%s", dirname, arg);
+            while (next_token(&args, &arg)) {
+                snprintf(board->ghosts_files[i], sizeof(board->ghosts_files[0]), "%s/%.*s", dirname, span_len(&arg), arg.p);
                 debug("MON file: %s\n", board->ghosts_files[i]);
                 i+= 1;
                 if (i == MAX_GHOSTS-1) break;
@@ -86,7 +182,7 @@ int read_level(board_t* board, char* filename, char* dirname) {
 
     if (!board->width || !board->height) {
         debug("Missing dimensions in level file\n");
-        close(fd);
+        close_text(&file);
         return -1;
     }
     
@@ -106,45 +202,37 @@ int read_level(board_t* board, char* filename, char* dirname) {
         perror("Memory Exceeded");
         exit(EXIT_FAILURE);
     }
+    alloc_layers(board);
 
     int row = 0;
-    // command here still holds the previous line
-    while (read > 0) {
-        if (command[0]== '#' || command[0] == '\0') continue;
-        if (row >= board->height) break;
+    // line here still holds the first line of the grid
+    for (; has_line && row < board->height; has_line = next_line(&text, &line)) {
+        if (skip_line(&line)) continue;
 
-        debug("Line: %s\n", command);
+        debug("Line: %.*s\n", span_len(&line), line.p);
 
+        int len = span_len(&line);
         for (int col = 0; col < board -> width; col++){
-            int idx = row * board->width + col;
-            char content = command[col];
+            // a short line is completed with dots
+            char content = (col < len) ? line.p[col] : 'o';
 
             switch (content) {
                 case 'X': // wall
-                    board->board[idx].content = 'W';
+                    board_write_cell(board, col, row, CELL_WALL);
                     break;
                 case '@': // portal
-                    board->board[idx].content = ' ';
-                    board->board[idx].has_portal = 1;
+                    board_write_cell(board, col, row, CELL_EMPTY | CELL_PORTAL);
                     break;
                 default:
-                    board->board[idx].content = ' ';
-                    board->board[idx].has_dot = 1;
+                    board_write_cell(board, col, row, CELL_EMPTY | CELL_DOT);
                     break;
             }
         }
 
         row++;
-        read = read_line(fd, command);
-    }
-
-    if (read == -1) {
-      debug("Failed parsing line");
-      close(fd);
-      return read;
     }
 
-    close(fd);
+    close_text(&file);
     return 0;
 }
 
@@ -161,10 +249,10 @@ int read_pacman(board_t* board, int points) {
         for (int i = 0; i < board->height; i++) {
             for (int j = 0; j < board->width; j++) {
                 int idx = i * board->width + j;
-                if (board->board[idx].content == ' ') {
+                if (cell_content(board->board[idx]) == CELL_EMPTY) {
                     pacman->pos_x = j;
                     pacman->pos_y = i;
-                    board->board[idx].content = 'P';
+                    board_write_cell(board, j, i, (board_pos_t)(board->board[idx] | CELL_PACMAN));
                     goto pacman_inserted;
                 }
             }
@@ -174,37 +262,36 @@ int read_pacman(board_t* board, int points) {
         return 0;
     }
 
-     int fd = open(board->pacman_file, O_RDONLY);
-     int read;
-     char command[MAX_COMMAND_LENGTH];
-     while ((read = read_line(fd, command)) > 0) {
-         if (read == -1) {
-             perror("Unable to read");
-             exit(EXIT_FAILURE);
-         }
+     pacman->n_moves = 0;
+
+     text_file_t file;
+     span_t text, line, word;
+     if (open_text(&file, board->pacman_file, &text) == -1) return -1;
+
+     while (next_line(&text, &line)) {
          //passa linhas desnecessarias
-         if (command[0] == '#' || command[0] == '\0') continue;
-         char *word = strtok(command, " \t\n");
+         if (skip_line(&line)) continue;
+         span_t args = line;
          // passa linhas vazias
-         if (!word) continue;
+         if (!next_token(&args, &word)) continue;
          //le o passo
-         if (strcmp(word, "PASSO") == 0) {
-             char *arg = strtok(NULL, " \t\n");
-            if (arg) {
-                 pacman->passo = atoi(arg);
+         if (token_is(&word, "PASSO")) {
+             span_t arg;
+             if (next_token(&args, &arg)) {
+                 pacman->passo = token_int(&arg);
                  pacman->waiting = pacman->passo;
                  debug("Pacman passo: %d\n", pacman->passo);
              }
          }
          //le a posiçao inicial
-         else if (strcmp(word, "POS") == 0) {
-             char *arg1 = strtok(NULL, " \t\n");
-             char *arg2 = strtok(NULL, " \t\n");
-             if (arg1 && arg2) {
-                 pacman->pos_x = atoi(arg1);
-                 pacman->pos_y = atoi(arg2);
+         else if (token_is(&word, "POS")) {
+             span_t arg1, arg2;
+             if (next_token(&args, &arg1) && next_token(&args, &arg2)) {
+                 pacman->pos_x = token_int(&arg1);
+                 pacman->pos_y = token_int(&arg2);
                  int idx = pacman->pos_y * board->width + pacman->pos_x;
-                 board->board[idx].content = 'P';
+                 board_pos_t cell = board->board[idx];
+                 board_write_cell(board, pacman->pos_x, pacman->pos_y, (board_pos_t)((cell & ~CELL_CONTENT) | CELL_PACMAN));
                  debug("Pacman Pos = %d x %d\n", pacman->pos_x, pacman->pos_y);
              }
          }
@@ -213,52 +300,43 @@ int read_pacman(board_t* board, int points) {
          }
      }
 
-    pacman->n_moves = 0;
-     if (read == -1) {
-         debug("Failed reading line\n");
-         close(fd);
-         return -1;
-     }
-
-     close(fd);
+     close_text(&file);
      return 0;
 }
 
 
 int read_ghosts(board_t* board) {
     for (int i = 0; i < board->n_ghosts; i++) {
-        int fd = open(board->ghosts_files[i], O_RDONLY);
         ghost_t* ghost = &board->ghosts[i];
 
-        int read;
-        char command[MAX_COMMAND_LENGTH];
-        while ((read = read_line(fd, command)) > 0) {
-            if (read == -1){
-                perror("Unable to read");
-                return -1;
-            }
+        text_file_t file;
+        span_t text, line, word;
+        if (open_text(&file, board->ghosts_files[i], &text) == -1) return -1;
+
+        int has_line;
+        while ((has_line = next_line(&text, &line))) {
             // comment
-            if (command[0] == '#' || command[0] == '\0') continue;
+            if (skip_line(&line)) continue;
 
-            char *word = strtok(command, " \t\n");
-            if (!word) continue;  // skip empty line
+            span_t args = line;
+            if (!next_token(&args, &word)) continue;  // skip blank line
 
-            if (strcmp(word, "PASSO") == 0) {
-                char *arg = strtok(NULL, " \t\n");
-                if (arg) {
-                    ghost->passo = atoi(arg);
+            if (token_is(&word, "PASSO")) {
+                span_t arg;
+                if (next_token(&args, &arg)) {
+                    ghost->passo = token_int(&arg);
                     ghost->waiting = ghost->passo;
                     debug("Ghost passo: %d\n", ghost->passo);
                 }
             }
-            else if (strcmp(word, "POS") == 0) {
-                char *arg1 = strtok(NULL, " \t\n");
-                char *arg2 = strtok(NULL, " \t\n");
-                if (arg1 && arg2) {
-                    ghost->pos_x = atoi(arg1);
-                    ghost->pos_y = atoi(arg2);
+            else if (token_is(&word, "POS")) {
+                span_t arg1, arg2;
+                if (next_token(&args, &arg1) && next_token(&args, &arg2)) {
+                    ghost->pos_x = token_int(&arg1);
+                    ghost->pos_y = token_int(&arg2);
                     int idx = ghost->pos_y * board->width + ghost->pos_x;
-                    board->board[idx].content = 'M';
+                    board_pos_t cell = board->board[idx];
+                    board_write_cell(board, ghost->pos_x, ghost->pos_y, (board_pos_t)((cell & ~CELL_CONTENT) | CELL_GHOST));
                     debug("Ghost Pos = %d x %d\n", ghost->pos_x, ghost->pos_y);
                 }
             }
@@ -270,61 +348,36 @@ int read_ghosts(board_t* board) {
         // end of the file contains the moves
         ghost->current_move = 0;
 
-        // command here still holds the previous line
+        // line here still holds the first move
         int move = 0;
-        while (read > 0 && move < MAX_MOVES) {
-            if (command[0]== '#' || command[0] == '\0') continue;
-            if (command[0] == 'A' ||
-                command[0] == 'D' ||
-                command[0] == 'W' ||
-                command[0] == 'S' ||
-                command[0] == 'R' ||
-                command[0] == 'C') {
-                    ghost->moves[move].command = command[0];
+        for (; has_line && move < MAX_MOVES; has_line = next_line(&text, &line)) {
+            if (skip_line(&line)) continue;
+            char command = line.p[0];
+            if (command == 'A' ||
+                command == 'D' ||
+                command == 'W' ||
+                command == 'S' ||
+                command == 'R' ||
+                command == 'C') {
+                    ghost->moves[move].command = command;
                     ghost->moves[move].turns = 1; 
                     move += 1;
             }
-            else if (command[0] == 'T' && command[1] == ' ') {
-                int t = atoi(command+2);
+            else if (command == 'T' && span_len(&line) > 1 && line.p[1] == ' ') {
+                span_t arg = { line.p + 2, line.end };
+                int t = token_int(&arg);
                 if (t > 0) {
-                    ghost->moves[move].command = command[0];
+                    ghost->moves[move].command = command;
                     ghost->moves[move].turns = t;
                     ghost->moves[move].turns_left = t;
                     move += 1;
                 }
             }
-            read = read_line(fd, command);
         }
         ghost->n_moves = move;
 
-        if (read == -1) {
-            debug("Failed reading line\n");
-            close(fd);
-            return -1;
-        }
-        close(fd);
+        close_text(&file);
     }
 
     return 0;
 }
-
-int read_line(int fd, char *buf) {
-    int i = 0;
-    char c;
-    ssize_t n;
-
-    while ((n = read(fd, &c, 1)) == 1) {
-        if (n == -1){
-            return -1;
-        }
-        if (c == '\r') continue;
-        if (c == '\n') break;
-        buf[i++] = c;
-        if (i == MAX_COMMAND_LENGTH - 1) break;
-    }
-
-    buf[i] = '\0';
-    if (n == -1) return -1;
-    if (n == 0 && i == 0) return 0;
-    return i;                         
-}
@@ -0,0 +1,376 @@
+#include "scheduler.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+
+// Resolucao da roda de timers (1 ms)
+#define WHEEL_TICK_NS 1000000LL
+// Roda hierarquica: 4 niveis de 64 slots cobrem 2^24 ms (~4.6 horas)
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+// Eventos lidos de cada vez pela thread do timer
+#define MAX_EVENTS 64
+
+// Estados de uma tarefa (o 0 e o de uma tarefa acabada de inicializar)
+#define TASK_IDLE 0
+#define TASK_WAITING 1
+#define TASK_READY 2
+#define TASK_RUNNING 3
+
+// Roda de timers global: cada slot e uma lista de tarefas
+// O nivel l guarda as tarefas que expiram daqui a menos de 64^(l+1) ticks
+static sched_task_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t wheel_occupied[WHEEL_LEVELS];   // Bit i ligado se o slot i tem tarefas
+static uint64_t wheel_now = 0;                  // Ultimo tick processado
+static long long wheel_origin_ns;               // Instante do tick 0
+static uint64_t wheel_armed = UINT64_MAX;       // Tick para o qual o timerfd esta armado
+static int timer_fd = -1;
+static int epoll_fd = -1;                       // timerfd e fds vigiados pelas tarefas
+
+// Tarefas que ja expiraram e estao a espera de um worker (FIFO)
+static sched_task_t *ready_head = NULL;
+static sched_task_t *ready_tail = NULL;
+
+static pthread_mutex_t scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int scheduler_default_workers(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return (int)n;
+}
+
+// Converte um instante (ns) no tick da roda em que expira (arredonda para cima)
+static uint64_t ns_to_tick(long long ns) {
+    if (ns <= wheel_origin_ns) return 0;
+    return (uint64_t)((ns - wheel_origin_ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS);
+}
+
+// Ultimo tick da roda que ja passou por completo
+static uint64_t elapsed_tick(long long ns) {
+    if (ns <= wheel_origin_ns) return 0;
+    return (uint64_t)((ns - wheel_origin_ns) / WHEEL_TICK_NS);
+}
+
+static long long tick_to_ns(uint64_t tick) {
+    return wheel_origin_ns + (long long)tick * WHEEL_TICK_NS;
+}
+
+// Mete uma tarefa no fim da lista de prontas e acorda um worker
+static void ready_push(sched_task_t *task) {
+    task->next = NULL;
+    task->prev = ready_tail;
+    if (ready_tail) ready_tail->next = task;
+    else ready_head = task;
+    ready_tail = task;
+    task->state = TASK_READY;
+    pthread_cond_signal(&ready_cond);
+}
+
+static sched_task_t *ready_pop(void) {
+    sched_task_t *task = ready_head;
+    ready_head = task->next;
+    if (ready_head) ready_head->prev = NULL;
+    else ready_tail = NULL;
+    task->next = task->prev = NULL;
+    task->state = TASK_RUNNING;
+    return task;
+}
+
+// Mete uma tarefa no slot certo da roda (o scheduler tem de estar bloqueado)
+static void wheel_insert(sched_task_t *task) {
+    if (task->expires <= wheel_now) {
+        ready_push(task);
+        return;
+    }
+
+    // Tarefas para la do alcance da roda ficam no ultimo nivel e voltam
+    // a ser colocadas quando esse slot e processado
+    uint64_t expires = task->expires;
+    if (expires - wheel_now >= WHEEL_RANGE) expires = wheel_now + WHEEL_RANGE - 1;
+
+    uint64_t delta = expires - wheel_now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) level++;
+    int slot = (int)((expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    task->prev = NULL;
+    task->next = wheel[level][slot];
+    if (task->next) task->next->prev = task;
+    wheel[level][slot] = task;
+    wheel_occupied[level] |= 1ULL << slot;
+    task->state = TASK_WAITING;
+    task->wheel_level = level;
+    task->wheel_slot = slot;
+}
+
+// Tira uma tarefa a espera do seu slot da roda (o timerfd pode ficar armado para nada)
+static void wheel_remove(sched_task_t *task) {
+    int level = task->wheel_level;
+    int slot = task->wheel_slot;
+    if (task->prev) task->prev->next = task->next;
+    else wheel[level][slot] = task->next;
+    if (task->next) task->next->prev = task->prev;
+    if (wheel[level][slot] == NULL) wheel_occupied[level] &= ~(1ULL << slot);
+    task->next = task->prev = NULL;
+}
+
+// Tira todas as tarefas de um slot
+static sched_task_t *wheel_take_slot(int level, int slot) {
+    sched_task_t *list = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    wheel_occupied[level] &= ~(1ULL << slot);
+    return list;
+}
+
+// Avanca a roda ate ao tick target, passando as tarefas expiradas para a lista de prontas
+static void wheel_advance(uint64_t target) {
+    while (wheel_now < target) {
+        // Salta os ticks em que nao ha nada para expirar nem para descer de nivel
+        uint64_t step = 1;
+        for (int l = 0; l < WHEEL_LEVELS - 1 && wheel_occupied[l] == 0; l++) {
+            step = 1ULL << (WHEEL_BITS * (l + 1));
+        }
+        uint64_t next = (wheel_now | (step - 1)) + 1;
+        if (next > target) next = target;
+        wheel_now = next;
+
+        // Nas fronteiras de cada nivel, desce as tarefas desse slot para os niveis de baixo
+        for (int l = WHEEL_LEVELS - 1; l >= 1; l--) {
+            if (wheel_now & ((1ULL << (WHEEL_BITS * l)) - 1)) continue;
+            int slot = (int)((wheel_now >> (WHEEL_BITS * l)) & WHEEL_MASK);
+            sched_task_t *task = wheel_take_slot(l, slot);
+            while (task) {
+                sched_task_t *next_task = task->next;
+                wheel_insert(task);
+                task = next_task;
+            }
+        }
+
+        sched_task_t *task = wheel_take_slot(0, (int)(wheel_now & WHEEL_MASK));
+        while (task) {
+            sched_task_t *next_task = task->next;
+            ready_push(task);
+            task = next_task;
+        }
+    }
+}
+
+// Proximo tick em que a roda tem trabalho (expirar ou descer de nivel)
+static uint64_t wheel_next_event(void) {
+    uint64_t next = UINT64_MAX;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        if (wheel_occupied[l] == 0) continue;
+        int shift = WHEEL_BITS * l;
+        int current = (int)((wheel_now >> shift) & WHEEL_MASK);
+        // Distancia (em slots deste nivel) ate ao slot ocupado mais proximo
+        uint64_t rotated = (wheel_occupied[l] >> current) | (wheel_occupied[l] << ((WHEEL_SLOTS - current) & WHEEL_MASK));
+        uint64_t distance = (uint64_t)__builtin_ctzll(rotated);
+        // No nivel 0 o slot atual ja foi processado; nos outros so volta a ser daqui a uma volta
+        if (distance == 0) distance = WHEEL_SLOTS;
+        uint64_t tick = ((wheel_now >> shift) + distance) << shift;
+        if (tick < next) next = tick;
+    }
+    return next;
+}
+
+// Arma o timerfd para o proximo evento da roda, se for mais cedo do que o atual
+static void wheel_rearm(bool force) {
+    uint64_t next = wheel_next_event();
+    if (!force && next >= wheel_armed) return;
+    wheel_armed = next;
+
+    struct itimerspec its = {0};
+    if (next != UINT64_MAX) {
+        long long ns = tick_to_ns(next);
+        its.it_value.tv_sec = ns / 1000000000LL;
+        its.it_value.tv_nsec = ns % 1000000000LL;
+    }
+    // it_value a zero desarma o timer quando a roda esta vazia
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("[ERR]: timerfd_settime failed");
+    }
+}
+
+// Agenda uma tarefa (o scheduler tem de estar bloqueado)
+static void schedule_locked(sched_task_t *task, long long deadline) {
+    long long now = monotonic_ns();
+    task->deadline = deadline;
+
+    // Atualiza a roda primeiro, para as posicoes serem relativas ao tempo atual
+    wheel_advance(elapsed_tick(now));
+
+    // Uma tarefa ja vencida vai logo para os workers
+    if (deadline <= now) {
+        ready_push(task);
+        return;
+    }
+    task->expires = ns_to_tick(deadline);
+    wheel_insert(task);
+    wheel_rearm(false);
+}
+
+void scheduler_submit(sched_task_t *task, long long deadline) {
+    pthread_mutex_lock(&scheduler_lock);
+    schedule_locked(task, deadline);
+    pthread_mutex_unlock(&scheduler_lock);
+}
+
+// O fd de uma tarefa ficou legivel: corre-a ja, sem esperar pela deadline
+// (o scheduler tem de estar bloqueado)
+static void wake_locked(sched_task_t *task) {
+    if (task->state == TASK_WAITING) {
+        wheel_remove(task);
+        ready_push(task);
+    } else if (task->state == TASK_RUNNING) {
+        // O worker volta a agenda-la logo que acabe o passo atual
+        task->woken = true;
+    }
+    // Prontas ja vao correr; paradas (sessao fechada) ignoram eventos atrasados
+}
+
+int scheduler_watch(sched_task_t *task, int fd) {
+    // Edge-triggered: so acorda quando chegam dados novos, a tarefa le tudo o que houver
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = task };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("[ERR]: epoll_ctl add failed");
+        return -1;
+    }
+    return 0;
+}
+
+void scheduler_unwatch(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Thread do timer: dorme ate a proxima deadline ou ate um fd vigiado ficar legivel
+// e entrega as tarefas expiradas ou acordadas
+static void *timer_thread(void *arg) {
+    (void) arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno != EINTR) perror("[ERR]: epoll_wait failed");
+            continue;
+        }
+
+        pthread_mutex_lock(&scheduler_lock);
+        bool expired = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) expired = true;
+            else wake_locked((sched_task_t*) events[i].data.ptr);
+        }
+        if (expired) {
+            uint64_t expirations;
+            ssize_t r = read(timer_fd, &expirations, sizeof(expirations));
+            if (r == -1 && errno != EINTR && errno != EAGAIN) {
+                perror("[ERR]: timerfd read failed");
+            }
+        }
+        wheel_advance(elapsed_tick(monotonic_ns()));
+        wheel_rearm(expired);
+        pthread_mutex_unlock(&scheduler_lock);
+    }
+    return NULL;
+}
+
+// Thread do pool: corre as tarefas prontas por ordem de chegada
+static void *worker_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&scheduler_lock);
+    while (true) {
+        if (ready_head == NULL) {
+            pthread_cond_wait(&ready_cond, &scheduler_lock);
+            continue;
+        }
+
+        sched_task_t *task = ready_pop();
+        pthread_mutex_unlock(&scheduler_lock);
+
+        // Uma tarefa so esta num worker de cada vez, por isso corre sem locks
+        long long next = task->run(task);
+
+        pthread_mutex_lock(&scheduler_lock);
+        // Se o passo acabou a sessao e o slot ja foi reaproveitado, a tarefa ja nao e desta corrida
+        if (task->state != TASK_RUNNING) continue;
+        if (next < 0) {
+            task->state = TASK_IDLE;
+            task->woken = false;
+        } else if (task->woken) {
+            // Chegaram dados enquanto corria: volta a correr ja, com a mesma deadline
+            task->woken = false;
+            task->deadline = next;
+            ready_push(task);
+        } else {
+            schedule_locked(task, next);
+        }
+    }
+    return NULL;
+}
+
+int scheduler_start(int n_workers) {
+    wheel_origin_ns = monotonic_ns();
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd == -1) {
+        perror("[ERR]: timerfd_create failed");
+        return -1;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("[ERR]: epoll_create1 failed");
+        return -1;
+    }
+    // O timerfd e o unico fd registado sem tarefa
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == -1) {
+        perror("[ERR]: epoll_ctl add failed");
+        return -1;
+    }
+
+    // Os workers nao tratam o SIGUSR1 (fica para a thread de hosting)
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, timer_thread, NULL) != 0) {
+        perror("[ERR]: Failed to create timer thread\n");
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    for (int i = 0; i < n_workers; i++) {
+        if (pthread_create(&tid, NULL, worker_thread, NULL) != 0) {
+            perror("[ERR]: Failed to create worker thread\n");
+            pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    debug("Scheduler started with %d workers\n", n_workers);
+    return 0;
+}
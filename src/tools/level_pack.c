@@ -0,0 +1,42 @@
+#include "level.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+Compilador de niveis: le os ficheiros .lvl, .p e .m de uma diretoria com o mesmo parser do server
+e escreve o level pack que o server mapeia no arranque (por omissao <diretoria>/levels.pack).
+Tem de ser corrido outra vez depois de alterar os ficheiros de texto.
+*/
+int main(int argc, char **argv) {
+    if (argc != 2 && argc != 3) {
+        printf("Usage: %s <level_directory> [ficheiro_de_saida]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char out_path[MAX_FILENAME];
+    if (argc == 3) {
+        snprintf(out_path, sizeof(out_path), "%s", argv[2]);
+    } else {
+        snprintf(out_path, sizeof(out_path), "%s/%s", argv[1], LEVEL_PACK_FILE);
+    }
+
+    open_debug_file("level_pack.log");
+    // Um pack antigo na diretoria nao conta: os niveis vem sempre do texto
+    level_cache_t *cache = level_cache_load_text(argv[1]);
+    if (cache == NULL) {
+        fprintf(stderr, "Failed to open directory %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (level_pack_write(cache, out_path) == -1) {
+        perror("Failed to write the level pack");
+        level_cache_free(cache);
+        exit(EXIT_FAILURE);
+    }
+    printf("%d levels written to %s\n", cache->n_levels, out_path);
+
+    level_cache_free(cache);
+    close_debug_file();
+    return 0;
+}
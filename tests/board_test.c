@@ -0,0 +1,63 @@
+#include "board.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+Testes das consultas por linha do board (board_ghosts_in_row) e da carga dos fantasmas, que as usa.
+Usa o nivel testing/1.lvl: fantasmas em (3, 2) e (2, 2) (coluna, linha), paredes nas colunas 0 e 5.
+Corre a partir da raiz do repositorio (make test).
+*/
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: falhou: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static int move(board_t *board, int ghost_index, char direction) {
+    command_t c = { .command = direction, .turns = 1, .turns_left = 1 };
+    return move_ghost(board, ghost_index, &c);
+}
+
+int main(void) {
+    open_debug_file("board_test.log");
+
+    board_t board;
+    if (load_level(&board, "1.lvl", "testing", 0) < 0) {
+        fprintf(stderr, "Failed to load testing/1.lvl\n");
+        exit(EXIT_FAILURE);
+    }
+
+    CHECK(board_ghosts_in_row(&board, 1) == 0);
+    CHECK(board_ghosts_in_row(&board, 2) == 2);
+
+    // Com outro fantasma na linha, a carga do fantasma 1 para antes dele
+    CHECK(move(&board, 1, 'C') == VALID_MOVE);
+    CHECK(move(&board, 1, 'D') == VALID_MOVE);
+    CHECK(board.ghosts[1].pos_x == 2 && board.ghosts[1].pos_y == 2);
+
+    // Desce para a linha de baixo: a contagem acompanha o movimento
+    CHECK(move(&board, 1, 'S') == VALID_MOVE);
+    CHECK(board_ghosts_in_row(&board, 2) == 1);
+    CHECK(board_ghosts_in_row(&board, 3) == 1);
+
+    // Sozinho na linha, carrega ate a parede
+    CHECK(move(&board, 1, 'C') == VALID_MOVE);
+    CHECK(move(&board, 1, 'D') == VALID_MOVE);
+    CHECK(board.ghosts[1].pos_x == 4 && board.ghosts[1].pos_y == 3);
+    CHECK(board_ghosts_in_row(&board, 3) == 1);
+
+    unload_level(&board);
+    close_debug_file();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d verificacoes falharam\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("board_test: ok\n");
+    return EXIT_SUCCESS;
+}
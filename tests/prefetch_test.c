@@ -0,0 +1,107 @@
+#include "api.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+Teste do nivel seguinte preparado durante o jogo (prefetch): um cliente que se desliga a meio
+de um nivel nao pode deixar a copia do nivel seguinte por libertar.
+O server corre neste processo (main do game.c como pacmanist_main) e o make liga o teste
+com o LeakSanitizer, que no fim acusa qualquer board perdido.
+Com um so jogo, o segundo cliente reaproveita a sessao do primeiro: uma copia que ficasse
+por libertar deixava de ter quem apontasse para ela.
+*/
+
+int pacmanist_main(int argc, char **argv);
+
+// Frames lidos por cliente: chega para passar o PREFETCH_DELAY_TICKS do server
+#define FRAMES_PER_CLIENT 24
+
+static char levels_dir[] = "/tmp/prefetch_test.XXXXXX";
+static char reg_path[64];
+
+// Niveis sem fantasmas e com TEMPO curto: o nivel so acaba quando o cliente sai
+static void write_level(const char *name) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", levels_dir, name);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("fopen failed");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "DIM 6 4\nTEMPO 5\nMON\nXXXXXX\nXooooX\nXoo@oX\nXXXXXX\n");
+    fclose(f);
+}
+
+static void *server_thread(void *arg) {
+    (void) arg;
+    char *argv[] = { "PacmanIST", levels_dir, "1", reg_path, NULL };
+    pacmanist_main(4, argv);
+    return NULL;
+}
+
+// Liga-se, le alguns frames do primeiro nivel e desliga-se a meio dele
+// (o server tira o id do cliente do nome do request pipe, /tmp/<id>_request)
+static int play_and_leave(int id) {
+    char req[64], notif[64];
+    snprintf(req, sizeof(req), "/tmp/%d_request", id);
+    snprintf(notif, sizeof(notif), "/tmp/%d_notification", id);
+    if (pacman_connect(req, notif, reg_path) != 0) {
+        fprintf(stderr, "client %d: connect failed\n", id);
+        return -1;
+    }
+    for (int i = 0; i < FRAMES_PER_CLIENT; i++) {
+        Board board = receive_board_update();
+        if (board.data == NULL || board.victory || board.game_over) {
+            fprintf(stderr, "client %d: level ended after %d frames\n", id, i);
+            pacman_disconnect();
+            unlink(req);
+            unlink(notif);
+            return -1;
+        }
+    }
+    pacman_disconnect();
+    unlink(req);
+    unlink(notif);
+    return 0;
+}
+
+int main(void) {
+    if (mkdtemp(levels_dir) == NULL) {
+        perror("mkdtemp failed");
+        exit(EXIT_FAILURE);
+    }
+    write_level("1.lvl");
+    write_level("2.lvl");
+    snprintf(reg_path, sizeof(reg_path), "%s/reg", levels_dir);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, server_thread, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    // Espera que o server crie o FIFO de registo
+    struct stat st;
+    for (int i = 0; i < 200 && stat(reg_path, &st) != 0; i++) sleep_ms(10);
+
+    int id = (int)getpid() * 10;
+    int failed = play_and_leave(id + 1) != 0 || play_and_leave(id + 2) != 0;
+
+    // Da tempo ao server para fechar a segunda sessao antes da verificacao de leaks a saida
+    sleep_ms(200);
+    unlink(reg_path);
+    for (int i = 1; i <= 2; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%d.lvl", levels_dir, i);
+        unlink(path);
+    }
+    rmdir(levels_dir);
+
+    if (failed) return EXIT_FAILURE;
+    printf("prefetch_test: ok\n");
+    return EXIT_SUCCESS;
+}